@@ -20,3 +20,21 @@ double mhz_full(int verbose, int sleeptime);
 void start_comp_counter();
 
 double get_comp_counter();
+
+/* Read the cycle counter directly, cheap enough to time single calls.
+   Where there is no rdtsc, nanoseconds of the monotonic clock instead. */
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static inline unsigned long long read_cycles(void)
+{
+    return __rdtsc();
+}
+#else
+#include <time.h>
+static inline unsigned long long read_cycles(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
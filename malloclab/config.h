@@ -58,6 +58,14 @@
  */
 #define MAX_HEAP (200*(1<<20))  /* 200 MB */
 
+/*
+ * Address space reserved by the mmap backend of memlib (MEM_USE_MMAP),
+ * which lets the heap grow past MAX_HEAP. Pages are committed in steps
+ * of MEM_COMMIT_UNIT bytes as the break moves up.
+ */
+#define MMAP_RESERVE ((size_t)1 << 36)  /* 64 GB */
+#define MEM_COMMIT_UNIT (64*(1<<10))   /* 64 KB */
+
 /*****************************************************************************
  * Set exactly one of these USE_xxx constants to "1" to select a timing method
  *****************************************************************************/
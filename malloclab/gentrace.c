@@ -0,0 +1,357 @@
+/*
+ * gentrace.c - Generate a synthetic .rep trace for mdriver
+ *
+ * usage: gentrace <params> <out.rep> [key=value ...]
+ *
+ * The parameter file has one "key value..." line per parameter, with
+ * '#' starting a comment. A key=value argument overrides the file, so
+ * one file gives a whole series of traces, e.g. for live=1000 up to
+ * live=1000000. The keys, with their defaults:
+ *
+ *   ops       100000     requests before the blocks still live are freed
+ *   seed      1          same parameters and seed give the same trace
+ *   live      1000       most blocks live at once, reached if the
+ *                        lifetimes are long enough
+ *   size      uniform 1 1024
+ *             sizes of new blocks in bytes, one of
+ *               fixed N | uniform MIN MAX | lognormal MU SIGMA |
+ *               pareto ALPHA MIN
+ *   size_max  1048576    larger sizes are cut to this
+ *   lifetime  exp 1000   requests a block lives for, one of
+ *               fixed N | uniform MIN MAX | exp MEAN | pareto ALPHA MIN |
+ *               bimodal SHORT LONG P (exponential with mean SHORT, or
+ *               with probability P mean LONG), means above 0
+ *   realloc   0 2 4      FRACTION GROWTH STEPS: this fraction of the
+ *                        blocks get 1 to STEPS reallocs spread over
+ *                        their life, each growing them GROWTH times
+ *
+ * Every request is the first of these that applies: the realloc or free
+ * of the block whose time has come, a new block if fewer than live are,
+ * or freeing the block with the nearest realloc or free early. Ids are
+ * reused once freed, so a trace has as many ids as blocks were live at
+ * once. Traces with millions of live blocks outgrow the heap of mdriver,
+ * use mdriver-mmap for those.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+
+#define MAXLINE 1024
+
+/* Kinds of distribution */
+enum {FIXED, UNIFORM, EXPONENTIAL, LOGNORMAL, PARETO, BIMODAL};
+
+typedef struct {
+    int kind;
+    double a, b, c;             /* parameters, in the order of the file */
+} dist_t;
+
+/* The parameters of a trace */
+typedef struct {
+    long ops;
+    unsigned long seed;
+    long live;
+    dist_t size;
+    long size_max;
+    dist_t lifetime;
+    double realloc_frac, realloc_growth;
+    int realloc_steps;
+} params_t;
+
+/* A live block, its id is its index in the blocks array */
+typedef struct {
+    long size;
+    long interval;              /* requests between its reallocs */
+    int reallocs;               /* reallocs still to come */
+    long death;                 /* when it is freed */
+} block_t;
+
+/* When the next request on the block id is due */
+typedef struct {
+    long time;
+    int id;
+} event_t;
+
+static unsigned long long rng_state;
+
+/*
+ * rng_next - xorshift64*, so a seed gives the same trace with any libc
+ */
+static unsigned long long rng_next(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+/* Uniform in (0, 1) */
+static double rng_unit(void)
+{
+    return ((rng_next() >> 11) + 0.5) / 9007199254740992.0;
+}
+
+static double rng_exp(double mean)
+{
+    return -mean * log(rng_unit());
+}
+
+static double dist_draw(const dist_t *d)
+{
+    switch (d->kind) {
+    case FIXED:
+	return d->a;
+    case UNIFORM:
+	return d->a + floor(rng_unit() * (d->b - d->a + 1));
+    case EXPONENTIAL:
+	return rng_exp(d->a);
+    case LOGNORMAL:
+	/* Box-Muller */
+	return exp(d->a + d->b * sqrt(-2 * log(rng_unit())) *
+		   cos(2 * M_PI * rng_unit()));
+    case PARETO:
+	return d->b / pow(rng_unit(), 1 / d->a);
+    case BIMODAL:
+	return rng_exp(rng_unit() < d->c ? d->b : d->a);
+    }
+    return 1;
+}
+
+/*
+ * clamp_draw - Cut a draw, or a size grown from one, to [1, max] while it
+ *     is still a double, since one too large for a long (or NaN) cannot be
+ *     converted to one
+ */
+static long clamp_draw(double x, long max)
+{
+    if (!(x >= 1))
+	return 1;
+    if (x > max)
+	return max;
+    return x;
+}
+
+static void param_error(const char *where, const char *msg)
+{
+    fprintf(stderr, "gentrace: %s: %s\n", where, msg);
+    exit(1);
+}
+
+/*
+ * parse_dist - Read a distribution from the words after its key
+ */
+static void parse_dist(dist_t *d, const char *where, char *args)
+{
+    char name[MAXLINE];
+    int n;
+
+    d->a = d->b = d->c = 0;
+    n = sscanf(args, "%s %lf %lf %lf", name, &d->a, &d->b, &d->c);
+    if (!strcmp(name, "fixed") && n == 2)
+	d->kind = FIXED;
+    else if (!strcmp(name, "uniform") && n == 3 && d->a <= d->b)
+	d->kind = UNIFORM;
+    else if (!strcmp(name, "exp") && n == 2 && d->a > 0)
+	d->kind = EXPONENTIAL;
+    else if (!strcmp(name, "lognormal") && n == 3)
+	d->kind = LOGNORMAL;
+    else if (!strcmp(name, "pareto") && n == 3 && d->a > 0)
+	d->kind = PARETO;
+    else if (!strcmp(name, "bimodal") && n == 4 && d->a > 0 && d->b > 0)
+	d->kind = BIMODAL;
+    else
+	param_error(where, "bad distribution");
+}
+
+/*
+ * parse_param - Set the parameter of one line, "key value..." or
+ *     "key=value..."
+ */
+static void parse_param(params_t *p, const char *where, char *line)
+{
+    char *key, *args;
+
+    line[strcspn(line, "#\n")] = '\0';
+    key = line + strspn(line, " \t");
+    if (*key == '\0')
+	return;
+    args = key + strcspn(key, " \t=");
+    if (*args)
+	*args++ = '\0';
+
+    if (!strcmp(key, "ops"))
+	p->ops = atol(args);
+    else if (!strcmp(key, "seed"))
+	p->seed = strtoul(args, NULL, 0);
+    else if (!strcmp(key, "live"))
+	p->live = atol(args);
+    else if (!strcmp(key, "size"))
+	parse_dist(&p->size, where, args);
+    else if (!strcmp(key, "size_max"))
+	p->size_max = atol(args);
+    else if (!strcmp(key, "lifetime"))
+	parse_dist(&p->lifetime, where, args);
+    else if (!strcmp(key, "realloc")) {
+	if (sscanf(args, "%lf %lf %d", &p->realloc_frac, &p->realloc_growth,
+		   &p->realloc_steps) != 3 || p->realloc_steps < 1)
+	    param_error(where, "bad realloc");
+    }
+    else
+	param_error(where, "unknown parameter");
+}
+
+/*
+ * Min-heap of the next event of every live block
+ */
+static void heap_push(event_t *heap, long *n, event_t e)
+{
+    long i = (*n)++;
+
+    for (; i > 0 && heap[(i - 1) / 2].time > e.time; i = (i - 1) / 2)
+	heap[i] = heap[(i - 1) / 2];
+    heap[i] = e;
+}
+
+static event_t heap_pop(event_t *heap, long *n)
+{
+    event_t top = heap[0], last = heap[--(*n)];
+    long i = 0, c;
+
+    for (; (c = 2 * i + 1) < *n; i = c) {
+	if (c + 1 < *n && heap[c + 1].time < heap[c].time)
+	    c++;
+	if (last.time <= heap[c].time)
+	    break;
+	heap[i] = heap[c];
+    }
+    heap[i] = last;
+    return top;
+}
+
+int main(int argc, char **argv)
+{
+    params_t p;
+    FILE *in, *out;
+    char line[MAXLINE], where[MAXLINE + 32];
+    block_t *blocks;
+    event_t *heap, e;
+    int *free_ids;
+    long num_events = 0, num_free_ids = 0, num_ids = 0, now = 0;
+    long live_bytes = 0, peak_bytes = 0, lineno = 0;
+    int i;
+
+    if (argc < 3) {
+	fprintf(stderr, "usage: %s <params> <out.rep> [key=value ...]\n", argv[0]);
+	exit(1);
+    }
+
+    /* Defaults, the file, then the command line */
+    memset(&p, 0, sizeof(p));
+    p.ops = 100000;
+    p.seed = 1;
+    p.live = 1000;
+    p.size.kind = UNIFORM;
+    p.size.a = 1;
+    p.size.b = 1024;
+    p.size_max = 1 << 20;
+    p.lifetime.kind = EXPONENTIAL;
+    p.lifetime.a = 1000;
+    p.realloc_growth = 2;
+    p.realloc_steps = 4;
+    if ((in = fopen(argv[1], "r")) == NULL) {
+	perror(argv[1]);
+	exit(1);
+    }
+    while (fgets(line, MAXLINE, in) != NULL) {
+	sprintf(where, "%.*s:%ld", MAXLINE, argv[1], ++lineno);
+	parse_param(&p, where, line);
+    }
+    fclose(in);
+    for (i = 3; i < argc; i++) {
+	snprintf(line, MAXLINE, "%s", argv[i]);
+	parse_param(&p, argv[i], line);
+    }
+    if (p.live < 1 || p.live > INT_MAX || p.ops < 0 || p.size_max < 1 ||
+	p.size_max > INT_MAX)
+	param_error(argv[1], "live, ops or size_max out of range");
+    rng_state = p.seed * 0x9E3779B97F4A7C15ULL + 1;
+
+    blocks = malloc(p.live * sizeof(block_t));
+    heap = malloc(p.live * sizeof(event_t));
+    free_ids = malloc(p.live * sizeof(int));
+    if (!blocks || !heap || !free_ids) {
+	fprintf(stderr, "gentrace: out of memory for %ld live blocks\n", p.live);
+	exit(1);
+    }
+
+    /* The header is written once the counts are known */
+    if ((out = fopen(argv[2], "w")) == NULL) {
+	perror(argv[2]);
+	exit(1);
+    }
+    fprintf(out, "%-20d\n%-20d\n%-20d\n%-20d\n", 0, 0, 0, 0);
+
+    while (now < p.ops || num_events > 0) {
+	block_t *b;
+	int id;
+
+	if (num_events > 0 && (heap[0].time <= now || now >= p.ops ||
+			       num_events == p.live)) {
+	    /* the next realloc or free, or one brought forward */
+	    e = heap_pop(heap, &num_events);
+	    b = &blocks[e.id];
+	    if (b->reallocs > 0 && e.time <= now && now < p.ops) {
+		live_bytes -= b->size;
+		b->size = clamp_draw(b->size * p.realloc_growth, p.size_max);
+		live_bytes += b->size;
+		fprintf(out, "r %d %ld\n", e.id, b->size);
+		b->reallocs--;
+		e.time = b->reallocs ? now + b->interval : b->death;
+		heap_push(heap, &num_events, e);
+	    }
+	    else {
+		live_bytes -= b->size;
+		fprintf(out, "f %d\n", e.id);
+		free_ids[num_free_ids++] = e.id;
+	    }
+	}
+	else {
+	    /* a new block */
+	    long life;
+
+	    id = num_free_ids ? free_ids[--num_free_ids] : num_ids++;
+	    b = &blocks[id];
+	    b->size = clamp_draw(dist_draw(&p.size), p.size_max);
+	    life = clamp_draw(dist_draw(&p.lifetime), LONG_MAX / 2);
+	    b->death = now + life;
+	    b->reallocs = 0;
+	    if (rng_unit() < p.realloc_frac) {
+		b->reallocs = 1 + rng_next() % p.realloc_steps;
+		b->interval = life / (b->reallocs + 1) + 1;
+	    }
+	    live_bytes += b->size;
+	    fprintf(out, "a %d %ld\n", id, b->size);
+	    e.id = id;
+	    e.time = b->reallocs ? now + b->interval : b->death;
+	    heap_push(heap, &num_events, e);
+	}
+	if (live_bytes > peak_bytes)
+	    peak_bytes = live_bytes;
+	now++;
+    }
+
+    /* The peak of the live bytes stands in for the suggested heap size */
+    rewind(out);
+    fprintf(out, "%-20ld\n%-20ld\n%-20ld\n%-20d\n",
+	    peak_bytes < INT_MAX ? peak_bytes : INT_MAX, num_ids, now, 1);
+    if (fclose(out) != 0) {
+	perror(argv[2]);
+	exit(1);
+    }
+    free(blocks);
+    free(heap);
+    free(free_ids);
+    return 0;
+}
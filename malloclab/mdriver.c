@@ -14,14 +14,24 @@
 #include <string.h>
 #include <assert.h>
 #include <float.h>
+#include <limits.h>
 #include <time.h>
 #include <getopt.h>
 #include <stdbool.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef MM_THREADS
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 #include "mm.h"
 #include "memlib.h"
 #include "fsecs.h"
+#include "clock.h"
 #include "config.h"
+#include "trace.h"
 
 /**********************
  * Constants and macros
@@ -31,24 +41,33 @@
 #define MAXLINE     1024 /* max string size */
 #define HDRLINES       4 /* number of header lines in a trace file */
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
+#define BATCH_MAX     64 /* most requests the batched replay (-B) makes at once */
+#define REGION_OBJS   64 /* objects the interface replay takes from a region before a reset */
+#define REGION_BLOCK 4096 /* block size of that region, larger objects get blocks of their own */
+#define MT_ROUND    4096 /* requests of a split trace (-S) between two rounds of frees */
 
 /****************************** 
  * The key compound data types 
  *****************************/
 
-/* Records the extent of each block's payload */
+/* Records the extent of each block's payload, in a treap ordered by lo */
 typedef struct range_t {
     char *lo;              /* low payload address */
     char *hi;              /* high payload address */
-    struct range_t *next;  /* next list element */
+    unsigned long prio;    /* heap order of the treap, a hash of lo */
+    struct range_t *left;  /* ranges below this one */
+    struct range_t *right; /* ranges above this one */
 } range_t;
 
-/* Characterizes a single trace operation (allocator request) */
+/* The region the interface replay takes objects from, and those objects */
 typedef struct {
-    enum {ALLOC, FREE, REALLOC} type; /* type of request */
-    int index;                        /* index for free() to use later */
-    int size;                         /* byte size of alloc/realloc request */
-} traceop_t;
+    mm_arena_t *region;
+    struct {
+	char *p;           /* the object */
+	int size;          /* its size, all filled with a byte of its index */
+    } objs[REGION_OBJS];
+    int nobjs;             /* objects taken since the last reset */
+} api_region_t;
 
 /* Holds the information for one trace file*/
 typedef struct {
@@ -57,6 +76,7 @@ typedef struct {
     int num_ops;         /* number of distinct requests */
     int weight;          /* weight for this trace (unused) */
     traceop_t *ops;      /* array of requests */
+    size_t map_len;      /* if set, ops points into a binary trace mapped this long */
     char **blocks;       /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes; /* ... and a corresponding array of payload sizes */
 } trace_t;
@@ -71,6 +91,52 @@ typedef struct {
     range_t *ranges;
 } speed_t;
 
+#ifdef MM_THREADS
+/* 
+ * Holds the params of one replay thread in the multithreaded mode. Each
+ * thread either replays a copy of the whole trace with blocks of its own,
+ * or, when the trace is split, the allocs and reallocs of the blocks it
+ * owns, with the block pointers shared by all threads, and the frees of
+ * those the thread before it gave up (see eval_mm_mt_worker).
+ */
+typedef struct mt_worker {
+    trace_t *trace;             /* trace to replay, shared by all threads */
+    char **blocks;              /* block pointers, shared when split */
+    int id;                     /* index of this thread */
+    int nthreads;               /* number of replay threads */
+    struct mt_worker *prev;     /* when split, the thread whose blocks this one frees */
+    char **freed;               /* when split, blocks given up this round */
+    int nfreed;                 /* number of those */
+    pthread_barrier_t *start;   /* released once every thread is ready */
+    pthread_barrier_t *round;   /* when split, ends each half of a round */
+    int ops;                    /* requests this thread replayed */
+    struct timeval t0, t1;      /* when this thread started and finished */
+} mt_worker_t;
+
+/* Throughput of one multithreaded replay */
+typedef struct {
+    double ops;                 /* requests replayed by all threads */
+    double secs;                /* first thread starting to last one done */
+    double min_kops;            /* slowest thread's own throughput */
+    double avg_kops;            /* average of the threads' own throughputs */
+    double max_kops;            /* fastest thread's own throughput */
+} mt_stats_t;
+#endif
+
+/* 
+ * Latency histogram of one request type in cycles. Values below
+ * 2^LAT_SUB_BITS have a bucket each, above that every power of two is
+ * split into 2^LAT_SUB_BITS buckets, so percentiles read off the buckets
+ * are within about 6% of the true value.
+ */
+#define LAT_SUB_BITS 4
+#define LAT_BUCKETS  (64 << LAT_SUB_BITS)
+typedef struct {
+    unsigned long count;                 /* requests timed */
+    unsigned long long max;              /* slowest request */
+    unsigned long buckets[LAT_BUCKETS];  /* requests per bucket */
+} lat_hist_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
     /* defined for both libc malloc and student malloc package (mm.c) */
@@ -91,6 +157,11 @@ typedef struct {
  *******************/
 int verbose = 0;        /* global flag for verbose output */
 static int errors = 0;  /* number of errs found when running student malloc */
+static int check_interval = 0; /* validate the heap every this many requests */
+static int check_mode = MM_CHECK_FAST; /* ... with this mm_validate mode */
+static FILE *timeline = NULL; /* write the heap over time here (-F) */
+static int timeline_interval = 0; /* ... every this many requests, 0 for 1% */
+static FILE *stats_dump = NULL; /* write mm_stats at the same requests here (-M) */
 char msg[MAXLINE];      /* for whenever we need to compose an error message */
 
 /* Directory where default tracefiles are found */
@@ -109,11 +180,18 @@ static char *default_tracefiles[] = {
 /* these functions manipulate range lists */
 static int add_range(range_t **ranges, char *lo, int size, 
 		     int tracenum, int opnum);
+static int check_usable(range_t **ranges, char *lo, int size,
+			int tracenum, int opnum);
 static void remove_range(range_t **ranges, char *lo);
 static void clear_ranges(range_t **ranges);
+static range_t *range_below(range_t *ranges, char *addr);
+static void range_split(range_t *ranges, char *lo, range_t **below,
+			range_t **rest);
+static range_t *range_merge(range_t *below, range_t *above);
 
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(char *tracedir, char *filename);
+static void map_trace(trace_t *trace, FILE *tracefile, char *path);
 static void free_trace(trace_t *trace);
 
 /* Routines for evaluating the correctness and speed of libc malloc */
@@ -123,8 +201,30 @@ static void eval_libc_speed(void *ptr);
 /* Routines for evaluating correctnes, space utilization, and speed 
    of the student's malloc package in mm.c */
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
+static int eval_mm_api_valid(trace_t *trace, int tracenum, range_t **ranges);
+static int replay_api(trace_t *trace, int tracenum, range_t **ranges,
+		      api_region_t *r);
+static int region_alloc(api_region_t *r, range_t **ranges, int size,
+			int tracenum, int opnum);
+static int region_reset(api_region_t *r, range_t **ranges, int tracenum,
+			int opnum);
 static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
 static void eval_mm_speed(void *ptr);
+static void eval_mm_batch(void *ptr);
+static int eval_mm_batch_valid(trace_t *trace, int tracenum);
+static int batch_end(trace_t *trace, int i);
+static void sample_heap(int tracenum, int opnum, int total_size);
+static void sample_stats(int tracenum, int opnum);
+static void eval_mm_latency(trace_t *trace, lat_hist_t *hists);
+
+/* These functions keep and report latency histograms */
+static void lat_record(lat_hist_t *hist, unsigned long long cycles);
+static unsigned long long lat_percentile(const lat_hist_t *hist, double p);
+static void print_latency(int n, char **tracefiles, lat_hist_t *hists, FILE *csv);
+#ifdef MM_THREADS
+static mt_stats_t eval_mm_mt(trace_t *trace, int nthreads, int split);
+static void *eval_mm_mt_worker(void *ptr);
+#endif
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats, bool perfindex);
@@ -150,6 +250,14 @@ int main(int argc, char **argv)
     speed_t speed_params;      /* input parameters to the xx_speed routines */ 
 
     int autograder = 0;  /* If set, emit summary info for autograder (-g) */
+    int latency = 0;     /* If set, measure the latency of each request (-L) */
+    int batched = 0;     /* If set, also time a batched replay (-B) */
+    FILE *csv = NULL;    /* If set, also write the latencies here (-m) */
+    lat_hist_t *lat_hists = NULL; /* malloc, free, realloc hists per trace */
+#ifdef MM_THREADS
+    int nthreads = 0;    /* If set, replay on 1 up to this many threads (-T) */
+    int split = 0;       /* If set, split traces across the threads (-S) */
+#endif
 
     /* temporaries used to compute the performance index */
     double perfindex;
@@ -161,7 +269,7 @@ int main(int argc, char **argv)
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "f:t:hvVgl")) != EOF) {
+    while ((c = getopt(argc, argv, "f:t:T:ShvVglLm:c:C:F:M:s:B")) != EOF) {
         switch (c) {
 	case 'g': /* Generate summary info for the autograder */
 	    autograder = 1;
@@ -181,6 +289,60 @@ int main(int argc, char **argv)
 	    if (tracedir[strlen(tracedir)-1] != '/') 
 		strcat(tracedir, "/"); /* path always ends with "/" */
 	    break;
+#ifdef MM_THREADS
+	case 'T': /* Replay each trace on 1 up to this many threads at once */
+	    nthreads = atoi(optarg);
+	    if (nthreads < 1) {
+		usage();
+		exit(1);
+	    }
+	    break;
+	case 'S': /* Split each trace across the threads instead of copying it */
+	    split = 1;
+	    break;
+#endif
+	case 'c': /* Validate the free lists every so many requests */
+	case 'C': /* Validate the whole heap every so many requests */
+	    check_interval = atoi(optarg);
+	    check_mode = c == 'c' ? MM_CHECK_FAST : MM_CHECK_DEEP;
+	    if (check_interval < 1) {
+		usage();
+		exit(1);
+	    }
+	    break;
+	case 'F': /* Write the fragmentation timeline of each trace to a file */
+	    if ((timeline = fopen(optarg, "w")) == NULL)
+		unix_error("ERROR: could not open timeline file in main");
+	    fprintf(timeline, "trace,op,heap,peak,live,free,free_chunks,"
+		    "largest_free,slab_free\n");
+	    break;
+	case 'M': /* Write the allocator's counters over each trace to a file */
+	    if ((stats_dump = fopen(optarg, "w")) == NULL)
+		unix_error("ERROR: could not open statistics file in main");
+	    fprintf(stats_dump, "trace,op,live,peak,heap,mallocs,frees,reallocs,"
+		    "splits,coalesces,search_steps");
+	    for (i = 0; i < MM_STATS_BINS; i++)
+		fprintf(stats_dump, ",bin%d", i);
+	    fprintf(stats_dump, "\n");
+	    break;
+	case 's': /* Sample the timeline and counters every so many requests */
+	    timeline_interval = atoi(optarg);
+	    if (timeline_interval < 1) {
+		usage();
+		exit(1);
+	    }
+	    break;
+	case 'B': /* Time a replay with runs of requests batched as well */
+	    batched = 1;
+	    break;
+	case 'L': /* Print latency percentiles of each request type */
+	    latency = 1;
+	    break;
+	case 'm': /* Write the latency percentiles to a CSV file as well */
+	    latency = 1;
+	    if ((csv = fopen(optarg, "w")) == NULL)
+		unix_error("ERROR: could not open latency file in main");
+	    break;
         case 'v': /* Print per-trace performance breakdown */
             verbose = 1;
             break;
@@ -253,6 +415,11 @@ int main(int argc, char **argv)
     mm_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
     if (mm_stats == NULL)
 	unix_error("mm_stats calloc in main failed");
+    if (latency) {
+	lat_hists = (lat_hist_t *)calloc(3*num_tracefiles, sizeof(lat_hist_t));
+	if (lat_hists == NULL)
+	    unix_error("lat_hists calloc in main failed");
+    }
     
     /* Initialize the simulated memory system in memlib.c */
     mem_init(); 
@@ -263,7 +430,8 @@ int main(int argc, char **argv)
 	mm_stats[i].ops = trace->num_ops;
 	if (verbose > 1)
 	    printf("Checking mm_malloc for correctness, ");
-	mm_stats[i].valid = eval_mm_valid(trace, i, &ranges);
+	mm_stats[i].valid = eval_mm_valid(trace, i, &ranges) &&
+	    eval_mm_api_valid(trace, i, &ranges);
 	if (mm_stats[i].valid) {
 	    if (verbose > 1)
 		printf("efficiency, ");
@@ -273,6 +441,8 @@ int main(int argc, char **argv)
 	    if (verbose > 1)
 		printf("and performance.\n");
 	    mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
+	    if (latency)
+		eval_mm_latency(trace, &lat_hists[3*i]);
 	}
 	free_trace(trace);
     }
@@ -285,6 +455,75 @@ int main(int argc, char **argv)
 	printf("\n");
     }
 
+    /* Display the latency percentiles of every valid trace */
+    if (latency) {
+	printf("Latency in cycles for mm malloc:\n");
+	print_latency(num_tracefiles, tracefiles, lat_hists, csv);
+	printf("\n");
+	if (csv != NULL)
+	    fclose(csv);
+    }
+
+    /*
+     * Optionally replay every valid trace with runs of frees, and of
+     * allocations of one size, made through the batch interface
+     */
+    if (batched) {
+	printf("Results for mm malloc with batched requests:\n");
+	printf("%5s%9s%9s%10s%10s%10s%8s\n", "trace", "ops", "batches",
+	       "secs", "Kops", "1-by-1", "ratio");
+	for (i=0; i < num_tracefiles; i++) {
+	    int batches = 0;
+	    double secs, single;
+
+	    if (!mm_stats[i].valid)
+		continue;
+	    trace = read_trace(tracedir, tracefiles[i]);
+	    for (int j = 0; j < trace->num_ops; j = batch_end(trace, j))
+		batches++;
+
+	    if (!eval_mm_batch_valid(trace, i)) {
+		free_trace(trace);
+		continue;
+	    }
+	    /* time both replays back to back, on the same heap */
+	    speed_params.trace = trace;
+	    single = fsecs(eval_mm_speed, &speed_params);
+	    secs = fsecs(eval_mm_batch, &speed_params);
+	    printf("%2d%12d%9d%10.6f%10.0f%10.0f%8.2f\n", i, trace->num_ops,
+		   batches, secs, (trace->num_ops/1e3)/secs,
+		   (trace->num_ops/1e3)/single, single/secs);
+	    free_trace(trace);
+	}
+	printf("\n");
+    }
+
+#ifdef MM_THREADS
+    /*
+     * Optionally replay every valid trace on 1 up to nthreads threads at
+     * once, reporting the total throughput and that of single threads
+     */
+    if (nthreads > 0) {
+	printf("Results for mm malloc on 1 to %d threads, %s:\n", nthreads,
+	       split ? "each trace split across them" : "each replaying the trace");
+	printf("%5s%4s%9s%10s%10s%26s\n", "trace", "thr", "ops", "secs", "Kops",
+	       "Kops/thread min/avg/max");
+	for (i=0; i < num_tracefiles; i++) {
+	    if (!mm_stats[i].valid)
+		continue;
+	    trace = read_trace(tracedir, tracefiles[i]);
+	    for (int n = 1; n <= nthreads; n++) {
+		mt_stats_t mt = eval_mm_mt(trace, n, split);
+		printf("%2d%6d%10.0f%10.6f  %8.0f  %8.0f%8.0f%8.0f\n", i, n, mt.ops,
+		       mt.secs, (mt.ops/1e3)/mt.secs,
+		       mt.min_kops, mt.avg_kops, mt.max_kops);
+	    }
+	    free_trace(trace);
+	}
+	printf("\n");
+    }
+#endif
+
     /* 
      * Compute and print the performance index 
      */
@@ -324,6 +563,11 @@ int main(int argc, char **argv)
     }
     free(libc_stats);
     free(mm_stats);
+    free(lat_hists);
+    if (timeline != NULL)
+	fclose(timeline);
+    if (stats_dump != NULL)
+	fclose(stats_dump);
     mem_deinit();
     clear_ranges(&ranges);
 
@@ -334,7 +578,9 @@ int main(int argc, char **argv)
 /*****************************************************************
  * The following routines manipulate the range list, which keeps 
  * track of the extent of every allocated block payload. We use the 
- * range list to detect any overlapping allocated blocks.
+ * range list to detect any overlapping allocated blocks. It is kept
+ * as a treap so that traces with millions of live blocks can be
+ * checked.
  ****************************************************************/
 
 /*
@@ -347,7 +593,7 @@ static int add_range(range_t **ranges, char *lo, int size,
 		     int tracenum, int opnum)
 {
     char *hi = lo + size - 1;
-    range_t *p;
+    range_t *p, *below, *rest;
     char msg[MAXLINE];
 
     assert(size > 0);
@@ -360,24 +606,26 @@ static int add_range(range_t **ranges, char *lo, int size,
         return 0;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
-	(hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of the heap or a mapped region */
+    if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
+	 (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+	!mem_is_mapped(lo, hi)) {
 	sprintf(msg, "Payload (%p:%p) lies outside heap (%p:%p)",
 		lo, hi, mem_heap_lo(), mem_heap_hi());
 	malloc_error(tracenum, opnum, msg);
         return 0;
     }
 
-    /* The payload must not overlap any other payloads */
-    for (p = *ranges;  p != NULL;  p = p->next) {
-        if ((lo >= p->lo && lo <= p-> hi) ||
-            (hi >= p->lo && hi <= p->hi)) {
-	    sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
-		    lo, hi, p->lo, p->hi);
-	    malloc_error(tracenum, opnum, msg);
-	    return 0;
-        }
+    /* 
+     * The payload must not overlap any other payloads. The payloads
+     * do not overlap each other, so if one does overlap, the last
+     * payload starting at or below hi does.
+     */
+    if ((p = range_below(*ranges, hi)) != NULL && p->hi >= lo) {
+	sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
+		lo, hi, p->lo, p->hi);
+	malloc_error(tracenum, opnum, msg);
+	return 0;
     }
 
     /* 
@@ -386,10 +634,35 @@ static int add_range(range_t **ranges, char *lo, int size,
      */
     if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
 	unix_error("malloc error in add_range");
-    p->next = *ranges;
     p->lo = lo;
     p->hi = hi;
-    *ranges = p;
+    p->prio = ((unsigned long)lo >> 4) * 0x9E3779B97F4A7C15UL;
+    p->left = p->right = NULL;
+    range_split(*ranges, lo, &below, &rest);
+    *ranges = range_merge(range_merge(below, p), rest);
+    return 1;
+}
+
+/*
+ * check_usable - Like add_range, but the range is all of the block that
+ *     mm_usable_size says is usable, which must be at least size bytes.
+ *     Its end is written to, so a block whose usable size is too large
+ *     overwrites what the package keeps there and tends to fail later on.
+ */
+static int check_usable(range_t **ranges, char *lo, int size,
+			int tracenum, int opnum)
+{
+    size_t usable = mm_usable_size(lo);
+
+    if (usable < (size_t)size || usable > INT_MAX) {
+	sprintf(msg, "mm_usable_size is %zu for a block of %d bytes",
+		usable, size);
+	malloc_error(tracenum, opnum, msg);
+	return 0;
+    }
+    if (add_range(ranges, lo, usable, tracenum, opnum) == 0)
+	return 0;
+    memset(lo + size, 0, usable - size);
     return 1;
 }
 
@@ -398,19 +671,12 @@ static int add_range(range_t **ranges, char *lo, int size,
  */
 static void remove_range(range_t **ranges, char *lo)
 {
-    range_t *p;
-    range_t **prevpp = ranges;
-   // int size;
+    range_t *below, *p, *above;
 
-    for (p = *ranges;  p != NULL; p = p->next) {
-        if (p->lo == lo) {
-	    *prevpp = p->next;
-    //        size = p->hi - p->lo + 1;
-            free(p);
-            break;
-        }
-        prevpp = &(p->next);
-    }
+    range_split(*ranges, lo, &below, &p);
+    range_split(p, lo + 1, &p, &above);
+    free(p);
+    *ranges = range_merge(below, above);
 }
 
 /*
@@ -418,14 +684,65 @@ static void remove_range(range_t **ranges, char *lo)
  */
 static void clear_ranges(range_t **ranges)
 {
-    range_t *p;
-    range_t *pnext;
+    if (*ranges == NULL)
+	return;
+    clear_ranges(&(*ranges)->left);
+    clear_ranges(&(*ranges)->right);
+    free(*ranges);
+    *ranges = NULL;
+}
+
+/*
+ * range_below - The range starting highest at or below addr, or NULL
+ */
+static range_t *range_below(range_t *ranges, char *addr)
+{
+    range_t *best = NULL;
 
-    for (p = *ranges;  p != NULL;  p = pnext) {
-        pnext = p->next;
-        free(p);
+    while (ranges != NULL) {
+	if (ranges->lo <= addr) {
+	    best = ranges;
+	    ranges = ranges->right;
+	}
+	else
+	    ranges = ranges->left;
     }
-    *ranges = NULL;
+    return best;
+}
+
+/*
+ * range_split - Split the ranges into those starting below lo and the rest
+ */
+static void range_split(range_t *ranges, char *lo, range_t **below,
+			range_t **rest)
+{
+    if (ranges == NULL)
+	*below = *rest = NULL;
+    else if (ranges->lo < lo) {
+	range_split(ranges->right, lo, &ranges->right, rest);
+	*below = ranges;
+    }
+    else {
+	range_split(ranges->left, lo, below, &ranges->left);
+	*rest = ranges;
+    }
+}
+
+/*
+ * range_merge - Join two treaps, all of below starting before above
+ */
+static range_t *range_merge(range_t *below, range_t *above)
+{
+    if (below == NULL)
+	return above;
+    if (above == NULL)
+	return below;
+    if (below->prio > above->prio) {
+	below->right = range_merge(below->right, above);
+	return below;
+    }
+    above->left = range_merge(below, above->left);
+    return above;
 }
 
 
@@ -434,7 +751,8 @@ static void clear_ranges(range_t **ranges)
  *********************************************/
 
 /*
- * read_trace - read a trace file and store it in memory
+ * read_trace - read a trace file and store it in memory, or map it
+ *     if it is a binary trace
  */
 static trace_t *read_trace(char *tracedir, char *filename)
 {
@@ -460,6 +778,14 @@ static trace_t *read_trace(char *tracedir, char *filename)
 	sprintf(msg, "Could not open %s in read_trace", path);
 	unix_error(msg);
     }
+    trace->map_len = 0;
+    if (fread(type, 1, strlen(TRACE_MAGIC), tracefile) == strlen(TRACE_MAGIC) &&
+	memcmp(type, TRACE_MAGIC, strlen(TRACE_MAGIC)) == 0) {
+	map_trace(trace, tracefile, path);
+	fclose(tracefile);
+	return trace;
+    }
+    rewind(tracefile);
     fscanf(tracefile, "%d", &(trace->sugg_heapsize)); /* not used */
     fscanf(tracefile, "%d", &(trace->num_ids));     
     fscanf(tracefile, "%d", &(trace->num_ops));     
@@ -503,6 +829,7 @@ static trace_t *read_trace(char *tracedir, char *filename)
 	    fscanf(tracefile, "%ud", &index);
 	    trace->ops[op_index].type = FREE;
 	    trace->ops[op_index].index = index;
+	    trace->ops[op_index].size = 0;
 	    break;
 	default:
 	    printf("Bogus type character (%c) in tracefile %s\n", 
@@ -519,13 +846,74 @@ static trace_t *read_trace(char *tracedir, char *filename)
     return trace;
 }
 
+/*
+ * map_trace - Map the requests of the binary trace open as tracefile
+ *     (see trace.h) into trace->ops. Every request is checked once here,
+ *     like the text reader checks its lines, after which the pages may be
+ *     dropped and read in again as the replay gets to them, so the trace
+ *     does not have to fit in memory.
+ */
+static void map_trace(trace_t *trace, FILE *tracefile, char *path)
+{
+    trace_hdr_t hdr;
+    struct stat st;
+    char *base;
+    int i;
+
+    rewind(tracefile);
+    if (fread(&hdr, sizeof(hdr), 1, tracefile) != 1 ||
+	fstat(fileno(tracefile), &st) < 0) {
+	sprintf(msg, "Could not read %s in map_trace", path);
+	unix_error(msg);
+    }
+    if (hdr.num_ops < 0 || hdr.num_ids < 0 || (size_t)st.st_size !=
+	sizeof(hdr) + (size_t)hdr.num_ops * sizeof(traceop_t)) {
+	sprintf(msg, "Truncated or corrupt binary trace %s", path);
+	app_error(msg);
+    }
+    trace->sugg_heapsize = hdr.sugg_heapsize;
+    trace->num_ids = hdr.num_ids;
+    trace->num_ops = hdr.num_ops;
+    trace->weight = hdr.weight;
+
+    trace->map_len = st.st_size;
+    base = mmap(NULL, trace->map_len, PROT_READ, MAP_PRIVATE,
+		fileno(tracefile), 0);
+    if (base == MAP_FAILED)
+	unix_error("mmap failed in map_trace");
+    madvise(base, trace->map_len, MADV_SEQUENTIAL);
+    trace->ops = (traceop_t *)(base + sizeof(hdr));
+
+    /* each request must name a block of the trace and a size it can have */
+    for (i = 0; i < trace->num_ops; i++) {
+	if (trace->ops[i].index >= (unsigned)trace->num_ids ||
+	    (trace->ops[i].type != FREE && trace->ops[i].size < 0) ||
+	    (trace->ops[i].type != ALLOC && trace->ops[i].type != FREE &&
+	     trace->ops[i].type != REALLOC)) {
+	    sprintf(msg, "Truncated or corrupt binary trace %s", path);
+	    app_error(msg);
+	}
+    }
+
+    if ((trace->blocks = 
+	 (char **)malloc(trace->num_ids * sizeof(char *))) == NULL)
+	unix_error("malloc 3 failed in map_trace");
+    if ((trace->block_sizes = 
+	 (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL)
+	unix_error("malloc 4 failed in map_trace");
+}
+
 /*
  * free_trace - Free the trace record and the three arrays it points
- *              to, all of which were allocated in read_trace().
+ *              to, all of which were allocated in read_trace(), or
+ *              unmap the requests if map_trace() mapped them.
  */
 void free_trace(trace_t *trace)
 {
-    free(trace->ops);         /* free the three arrays... */
+    if (trace->map_len)       /* unmap a binary trace... */
+	munmap((char *)trace->ops - sizeof(trace_hdr_t), trace->map_len);
+    else
+	free(trace->ops);     /* ...or free the three arrays... */
     free(trace->blocks);      
     free(trace->block_sizes);
     free(trace);              /* and the trace record itself... */
@@ -579,7 +967,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	     * to the range list if OK. The block must be  be aligned properly,
 	     * and must not overlap any currently allocated block. 
 	     */ 
-	    if (add_range(ranges, p, size, tracenum, i) == 0)
+	    if (check_usable(ranges, p, size, tracenum, i) == 0)
 		return 0;
 	    
 	    /* ADDED: cgw
@@ -607,7 +995,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    remove_range(ranges, oldp);
 	    
 	    /* Check new block for correctness and add it to range list */
-	    if (add_range(ranges, newp, size, tracenum, i) == 0)
+	    if (check_usable(ranges, newp, size, tracenum, i) == 0)
 		return 0;
 	    
 	    /* ADDED: cgw
@@ -618,7 +1006,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    oldsize = trace->block_sizes[index];
 	    if (size < oldsize) oldsize = size;
 	    for (j = 0; j < oldsize; j++) {
-	      if (newp[j] != (index & 0xFF)) {
+	      if ((unsigned char)newp[j] != (index & 0xFF)) {
 		malloc_error(tracenum, i, "mm_realloc did not preserve the "
 			     "data from old block");
 		return 0;
@@ -643,12 +1031,225 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    app_error("Nonexistent request type in eval_mm_valid");
         }
 
+	/* Optionally have the package check its own heap */
+	if (check_interval > 0 && (i + 1) % check_interval == 0) {
+	    const char *err = mm_validate(check_mode);
+	    if (err != NULL) {
+		sprintf(msg, "mm_validate: %s", err);
+		malloc_error(tracenum, i, msg);
+		return 0;
+	    }
+	}
     }
 
     /* As far as we know, this is a valid malloc package */
     return 1;
 }
 
+
+/*
+ * eval_mm_api_valid - Check the calls of the mm package that the other
+ *     passes do not make, in a second replay of the trace, see
+ *     replay_api. The region the replay takes objects from is destroyed
+ *     whether the replay passes or not, after which the heap must check out.
+ */
+static int eval_mm_api_valid(trace_t *trace, int tracenum, range_t **ranges)
+{
+    api_region_t r;
+    const char *err;
+    int ok;
+
+    /* Reset the heap and free any records in the range list */
+    mem_reset_brk();
+    clear_ranges(ranges);
+    if (mm_init() < 0) {
+	malloc_error(tracenum, 0, "mm_init failed.");
+	return 0;
+    }
+    if ((r.region = mm_arena_create(REGION_BLOCK)) == NULL) {
+	malloc_error(tracenum, 0, "mm_arena_create failed.");
+	return 0;
+    }
+    r.nobjs = 0;
+
+    ok = replay_api(trace, tracenum, ranges, &r) &&
+	region_reset(&r, ranges, tracenum, trace->num_ops - 1);
+    mm_arena_destroy(r.region);
+    if (ok && (err = mm_validate(MM_CHECK_DEEP)) != NULL) {
+	sprintf(msg, "mm_validate after the replay: %s", err);
+	malloc_error(tracenum, trace->num_ops - 1, msg);
+	ok = 0;
+    }
+    return ok;
+}
+
+/*
+ * replay_api - Replay the trace for eval_mm_api_valid. One block in
+ *     four asks for an alignment of 32 to 256 bytes, half of them through
+ *     mm_memalign and half through mm_aligned_alloc, and one in four comes
+ *     from mm_calloc, which must have cleared it even when it reuses a
+ *     block the replay filled before it was freed. Every other block is
+ *     freed with mm_free_sized. The other blocks, reallocs and frees go
+ *     through the calls eval_mm_valid makes. For the rest of the blocks an
+ *     object of the same size is also allocated from the region r, whose
+ *     4 KB blocks make the larger ones objects with blocks of their own,
+ *     and the region is reset every REGION_OBJS objects.
+ */
+static int replay_api(trace_t *trace, int tracenum, range_t **ranges,
+		      api_region_t *r)
+{
+    int i, j;
+    int index;
+    int size;
+    int oldsize;
+    size_t align;
+    char *newp;
+    char *oldp;
+    char *p;
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+	size = trace->ops[i].size;
+
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* mm_memalign, mm_aligned_alloc, mm_calloc or mm_malloc */
+	    if (size < 0) {
+		malloc_error(tracenum, i, "negative block size");
+		return 0;
+	    }
+	    align = index % 4 == 1 ? (size_t)32 << (index / 4 % 4) : 0;
+	    if (index % 4 == 2)
+		p = mm_calloc(1, size);
+	    else if (align == 0)
+		p = mm_malloc(size);
+	    else if (index % 8 == 1)
+		p = mm_memalign(align, size);
+	    else
+		p = mm_aligned_alloc(align, size);
+	    if (p == NULL) {
+		malloc_error(tracenum, i, index % 4 == 2 ? "mm_calloc failed." :
+			     align == 0 ? "mm_malloc failed." :
+			     index % 8 == 1 ? "mm_memalign failed." :
+			     "mm_aligned_alloc failed.");
+		return 0;
+	    }
+	    if (align != 0 && ((size_t)p & (align - 1)) != 0) {
+		sprintf(msg, "mm_memalign block %p is not aligned to %zu bytes",
+			p, align);
+		malloc_error(tracenum, i, msg);
+		return 0;
+	    }
+	    if (check_usable(ranges, p, size, tracenum, i) == 0)
+		return 0;
+	    if (index % 4 == 2) {
+		for (j = 0; j < size; j++) {
+		    if (p[j] != 0) {
+			malloc_error(tracenum, i, "mm_calloc did not clear "
+				     "the block");
+			return 0;
+		    }
+		}
+	    }
+	    memset(p, index & 0xFF, size);
+	    trace->blocks[index] = p;
+	    trace->block_sizes[index] = size;
+
+	    /* An object of the same size from the region as well */
+	    if (index % 4 == 3 &&
+		region_alloc(r, ranges, size, tracenum, i) == 0)
+		return 0;
+	    break;
+
+        case REALLOC: /* mm_realloc, which must keep the data */
+	    oldp = trace->blocks[index];
+	    if ((newp = mm_realloc(oldp, size)) == NULL) {
+		malloc_error(tracenum, i, "mm_realloc failed.");
+		return 0;
+	    }
+	    remove_range(ranges, oldp);
+	    if (check_usable(ranges, newp, size, tracenum, i) == 0)
+		return 0;
+	    oldsize = trace->block_sizes[index];
+	    if (size < oldsize) oldsize = size;
+	    for (j = 0; j < oldsize; j++) {
+		if ((unsigned char)newp[j] != (index & 0xFF)) {
+		    malloc_error(tracenum, i, "mm_realloc did not preserve the "
+				 "data from old block");
+		    return 0;
+		}
+	    }
+	    memset(newp, index & 0xFF, size);
+	    trace->blocks[index] = newp;
+	    trace->block_sizes[index] = size;
+	    break;
+
+        case FREE: /* mm_free_sized or mm_free */
+	    p = trace->blocks[index];
+	    remove_range(ranges, p);
+	    if (index % 2 == 1)
+		mm_free_sized(p, trace->block_sizes[index]);
+	    else
+		mm_free(p);
+	    break;
+
+	default:
+	    app_error("Nonexistent request type in eval_mm_api_valid");
+        }
+    }
+    return 1;
+}
+
+/*
+ * region_alloc - Allocate an object of size bytes from the region of
+ *     the interface replay, after a reset when it holds REGION_OBJS of
+ *     them. The object goes on the range list and is filled with its index.
+ */
+static int region_alloc(api_region_t *r, range_t **ranges, int size,
+			int tracenum, int opnum)
+{
+    char *p;
+
+    if (r->nobjs == REGION_OBJS &&
+	region_reset(r, ranges, tracenum, opnum) == 0)
+	return 0;
+    if ((p = mm_arena_alloc(r->region, size)) == NULL) {
+	malloc_error(tracenum, opnum, "mm_arena_alloc failed.");
+	return 0;
+    }
+    if (add_range(ranges, p, size, tracenum, opnum) == 0)
+	return 0;
+    memset(p, r->nobjs, size);
+    r->objs[r->nobjs].p = p;
+    r->objs[r->nobjs++].size = size;
+    return 1;
+}
+
+/*
+ * region_reset - Check that the objects of the interface replay's region
+ *     still hold what was written to them, take them off the range list
+ *     and reset the region, which frees them all
+ */
+static int region_reset(api_region_t *r, range_t **ranges, int tracenum,
+			int opnum)
+{
+    int j, k;
+
+    for (k = 0; k < r->nobjs; k++) {
+	for (j = 0; j < r->objs[k].size; j++) {
+	    if ((unsigned char)r->objs[k].p[j] != k) {
+		malloc_error(tracenum, opnum, "mm_arena_alloc object was "
+			     "overwritten");
+		return 0;
+	    }
+	}
+	remove_range(ranges, r->objs[k].p);
+    }
+    r->nobjs = 0;
+    mm_arena_reset(r->region);
+    return 1;
+}
+
 /* 
  * eval_mm_util - Evaluate the space utilization of the student's package
  *   The idea is to remember the high water mark "hwm" of the heap for 
@@ -667,6 +1268,7 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
     int size, newsize, oldsize;
     int max_total_size = 0;
     int total_size = 0;
+    int interval = timeline_interval;
     char *p;
     char *newp, *oldp;
 
@@ -675,6 +1277,14 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
     if (mm_init() < 0)
 	app_error("mm_init failed in eval_mm_util");
 
+    /* by default the timeline has about a hundred samples per trace */
+    if (interval == 0)
+	interval = trace->num_ops >= 100 ? trace->num_ops / 100 : 1;
+    if (timeline != NULL)
+	sample_heap(tracenum, 0, 0);
+    if (stats_dump != NULL)
+	sample_stats(tracenum, 0);
+
     for (i = 0;  i < trace->num_ops;  i++) {
         switch (trace->ops[i].type) {
 
@@ -737,12 +1347,160 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    app_error("Nonexistent request type in eval_mm_util");
 
         }
+
+	/* Optionally sample the heap, always after the last request */
+	if ((i + 1) % interval == 0 || i + 1 == trace->num_ops) {
+	    if (timeline != NULL)
+		sample_heap(tracenum, i + 1, total_size);
+	    if (stats_dump != NULL)
+		sample_stats(tracenum, i + 1);
+	}
     }
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    /* the allocator may have shrunk the heap, charge it for its largest size */
+    return ((double)max_total_size / (double)mem_peak_heapsize());
 }
 
 
+/*
+ * sample_heap - Write a line of the fragmentation timeline: the heap
+ *     and the free memory in it once opnum requests are done, with
+ *     total_size bytes of payload live. heap counts the mapped regions
+ *     too, peak is the largest heap so far that the utilization charges.
+ */
+static void sample_heap(int tracenum, int opnum, int total_size)
+{
+    mm_heapinfo_t info;
+
+    mm_heapinfo(&info);
+    fprintf(timeline, "%d,%d,%zu,%zu,%d,%zu,%zu,%zu,%zu\n", tracenum, opnum,
+	    mem_heapsize() + mem_mapsize(), mem_peak_heapsize(), total_size,
+	    info.free_bytes, info.free_chunks, info.largest_free,
+	    info.slab_free_bytes);
+}
+
+/*
+ * sample_stats - Write a line of the allocator's counters once opnum
+ *     requests are done, as mm_stats reports them
+ */
+static void sample_stats(int tracenum, int opnum)
+{
+    mm_stats_t st;
+    int i;
+
+    mm_stats(&st);
+    fprintf(stats_dump, "%d,%d,%zu,%zu,%zu,%zu,%zu,%zu,%zu,%zu,%zu",
+	    tracenum, opnum, st.live_bytes, st.peak_bytes, st.heap_size,
+	    st.mallocs, st.frees, st.reallocs, st.splits, st.coalesces,
+	    st.search_steps);
+    for (i = 0; i < MM_STATS_BINS; i++)
+	fprintf(stats_dump, ",%zu", st.bin_chunks[i]);
+    fprintf(stats_dump, "\n");
+}
+
+/*
+ * batch_end - Returns where the batch of requests the batched replay
+ *     starts at request i ends: a run of frees, or of allocations of one
+ *     size, at most BATCH_MAX long, while reallocs go one by one
+ */
+static int batch_end(trace_t *trace, int i)
+{
+    traceop_t *op = &trace->ops[i];
+    int j = i + 1;
+
+    if (op->type == REALLOC)
+	return j;
+    while (j < trace->num_ops && j - i < BATCH_MAX &&
+	   trace->ops[j].type == op->type &&
+	   (op->type == FREE || trace->ops[j].size == op->size))
+	j++;
+    return j;
+}
+
+/*
+ * eval_mm_batch_valid - Replay the trace once with eval_mm_batch and check
+ *     the heap after it. When the trace frees every block it allocates,
+ *     the heap must also be empty: no frees are sized, so the live bytes
+ *     the allocator counts are exact and must be back at 0.
+ */
+static int eval_mm_batch_valid(trace_t *trace, int tracenum)
+{
+    int i, live = 0;
+    const char *err;
+    mm_stats_t st;
+    speed_t params;
+
+    params.trace = trace;
+    eval_mm_batch(&params);
+    if ((err = mm_validate(MM_CHECK_DEEP)) != NULL) {
+	sprintf(msg, "mm_validate after the batched replay: %s", err);
+	malloc_error(tracenum, trace->num_ops - 1, msg);
+	return 0;
+    }
+
+    for (i = 0; i < trace->num_ops; i++) {
+	if (trace->ops[i].type == ALLOC)
+	    live++;
+	else if (trace->ops[i].type == FREE)
+	    live--;
+    }
+    mm_stats(&st);
+    if (live == 0 && st.live_bytes != 0) {
+	sprintf(msg, "%zu bytes still live after the batched replay freed "
+		"every block", st.live_bytes);
+	malloc_error(tracenum, trace->num_ops - 1, msg);
+	return 0;
+    }
+    return 1;
+}
+
+/*
+ * eval_mm_batch - Like eval_mm_speed, but runs of requests are made at
+ *     once with mm_malloc_batch and mm_free_batch
+ */
+static void eval_mm_batch(void *ptr)
+{
+    int i, j, k;
+    char *newp;
+    void *batch[BATCH_MAX];
+    traceop_t *op;
+    trace_t *trace = ((speed_t *)ptr)->trace;
+
+    /* Reset the heap and initialize the mm package */
+    mem_reset_brk();
+    if (mm_init() < 0)
+	app_error("mm_init failed in eval_mm_batch");
+
+    for (i = 0; i < trace->num_ops; i = j) {
+	op = &trace->ops[i];
+	j = batch_end(trace, i);
+	switch (op->type) {
+
+	case ALLOC: /* mm_malloc_batch */
+	    if (mm_malloc_batch(op->size, j - i, batch) != (size_t)(j - i))
+		app_error("mm_malloc_batch error in eval_mm_batch");
+	    for (k = i; k < j; k++)
+		trace->blocks[trace->ops[k].index] = batch[k - i];
+	    break;
+
+	case REALLOC: /* mm_realloc */
+	    if ((newp = mm_realloc(trace->blocks[op->index], op->size)) == NULL)
+		app_error("mm_realloc error in eval_mm_batch");
+	    trace->blocks[op->index] = newp;
+	    break;
+
+	case FREE: /* mm_free_batch */
+	    for (k = i; k < j; k++)
+		batch[k - i] = trace->blocks[trace->ops[k].index];
+	    mm_free_batch(batch, j - i);
+	    break;
+
+	default:
+	    app_error("Nonexistent request type in eval_mm_batch");
+	}
+    }
+}
+
 /*
  * eval_mm_speed - This is the function that is used by fcyc()
  *    to measure the running time of the mm malloc package.
@@ -790,6 +1548,214 @@ static void eval_mm_speed(void *ptr)
         }
 }
 
+/*
+ * eval_mm_latency - Replay the trace once more, timing each request on
+ *    its own with the cycle counter. hists[t] collects the requests of
+ *    traceop_t t. The reads of the counter are part of every sample,
+ *    so only compare latencies measured the same way.
+ */
+static void eval_mm_latency(trace_t *trace, lat_hist_t *hists)
+{
+    int i, index;
+    void *p;
+    unsigned long long t0, t1;
+
+    mem_reset_brk();
+    if (mm_init() < 0) 
+	app_error("mm_init failed in eval_mm_latency");
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+	switch (trace->ops[i].type) {
+
+	case ALLOC: /* mm_malloc */
+	    t0 = read_cycles();
+	    p = mm_malloc(trace->ops[i].size);
+	    t1 = read_cycles();
+	    if (p == NULL)
+		app_error("mm_malloc error in eval_mm_latency");
+	    trace->blocks[index] = p;
+	    break;
+
+	case REALLOC: /* mm_realloc */
+	    t0 = read_cycles();
+	    p = mm_realloc(trace->blocks[index], trace->ops[i].size);
+	    t1 = read_cycles();
+	    if (p == NULL)
+		app_error("mm_realloc error in eval_mm_latency");
+	    trace->blocks[index] = p;
+	    break;
+
+	case FREE: /* mm_free */
+	    t0 = read_cycles();
+	    mm_free(trace->blocks[index]);
+	    t1 = read_cycles();
+	    break;
+
+	default:
+	    app_error("Nonexistent request type in eval_mm_latency");
+	}
+	lat_record(&hists[trace->ops[i].type], t1 - t0);
+    }
+}
+
+#ifdef MM_THREADS
+/*
+ * eval_mm_mt - Replay the trace on nthreads threads against one shared
+ *    heap. Each thread replays a private copy of the trace, or with split
+ *    set, a share of it in which blocks are freed by another thread than
+ *    the one that allocated them. Returns the requests replayed, the wall
+ *    clock seconds from the first thread starting until the last one is
+ *    done, and the throughput of single threads.
+ */
+static mt_stats_t eval_mm_mt(trace_t *trace, int nthreads, int split)
+{
+    int i;
+    pthread_t *tids;
+    mt_worker_t *workers;
+    pthread_barrier_t start, round;
+    struct timeval t0, t1;
+    mt_stats_t stats;
+
+    if ((tids = (pthread_t *)calloc(nthreads, sizeof(pthread_t))) == NULL)
+	unix_error("calloc 1 failed in eval_mm_mt");
+    if ((workers = (mt_worker_t *)calloc(nthreads, sizeof(mt_worker_t))) == NULL)
+	unix_error("calloc 2 failed in eval_mm_mt");
+
+    /* Reset the heap and initialize the mm package */
+    mem_reset_brk();
+    if (mm_init() < 0)
+	app_error("mm_init failed in eval_mm_mt");
+
+    pthread_barrier_init(&start, NULL, nthreads + 1);
+    pthread_barrier_init(&round, NULL, nthreads);
+    for (i = 0; i < nthreads; i++) {
+	workers[i].trace = trace;
+	workers[i].id = i;
+	workers[i].nthreads = nthreads;
+	workers[i].start = &start;
+	if (split) {
+	    workers[i].blocks = trace->blocks;
+	    workers[i].prev = &workers[(i + nthreads - 1) % nthreads];
+	    workers[i].round = &round;
+	    if ((workers[i].freed =
+		 (char **)malloc(MT_ROUND * sizeof(char *))) == NULL)
+		unix_error("malloc failed in eval_mm_mt");
+	}
+	else if ((workers[i].blocks =
+		  (char **)malloc(trace->num_ids * sizeof(char *))) == NULL)
+	    unix_error("malloc failed in eval_mm_mt");
+	if (pthread_create(&tids[i], NULL, eval_mm_mt_worker, &workers[i]) != 0)
+	    unix_error("pthread_create failed in eval_mm_mt");
+    }
+
+    pthread_barrier_wait(&start);
+    for (i = 0; i < nthreads; i++)
+	pthread_join(tids[i], NULL);
+
+    t0 = workers[0].t0;
+    t1 = workers[0].t1;
+    stats.ops = 0;
+    stats.min_kops = DBL_MAX;
+    stats.avg_kops = 0;
+    stats.max_kops = 0;
+    for (i = 0; i < nthreads; i++) {
+	mt_worker_t *w = &workers[i];
+	double secs = (w->t1.tv_sec - w->t0.tv_sec) + (w->t1.tv_usec - w->t0.tv_usec) / 1e6;
+	double kops = secs > 0 ? (w->ops / 1e3) / secs : 0;
+	if (timercmp(&w->t0, &t0, <))
+	    t0 = w->t0;
+	if (timercmp(&w->t1, &t1, >))
+	    t1 = w->t1;
+	stats.ops += w->ops;
+	stats.avg_kops += kops / nthreads;
+	if (kops < stats.min_kops)
+	    stats.min_kops = kops;
+	if (kops > stats.max_kops)
+	    stats.max_kops = kops;
+    }
+    stats.secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec) / 1e6;
+
+    pthread_barrier_destroy(&start);
+    pthread_barrier_destroy(&round);
+    for (i = 0; i < nthreads; i++) {
+	if (split)
+	    free(workers[i].freed);
+	else
+	    free(workers[i].blocks);
+    }
+    free(workers);
+    free(tids);
+    return stats;
+}
+
+/*
+ * eval_mm_mt_worker - Body of one replay thread in eval_mm_mt. When the
+ *    trace is split, blocks are dealt out round robin by id and the trace
+ *    is replayed in rounds of MT_ROUND requests. In the first half of a
+ *    round each thread makes the allocs and reallocs of its own blocks and
+ *    sets aside those the trace frees. In the second half it frees the ones
+ *    the thread before it set aside, so threads wait on each other only
+ *    twice a round, not for every block another one frees.
+ */
+static void *eval_mm_mt_worker(void *ptr)
+{
+    int i, j, first, last, index;
+    char *p;
+    mt_worker_t *w = (mt_worker_t *)ptr;
+    trace_t *trace = w->trace;
+    int split = w->prev != NULL;
+    int round = split ? MT_ROUND : trace->num_ops;
+
+    pthread_barrier_wait(w->start);
+    gettimeofday(&w->t0, NULL);
+    for (first = 0; first < trace->num_ops; first += round) {
+	last = first + round < trace->num_ops ? first + round : trace->num_ops;
+	for (i = first;  i < last;  i++) {
+	    index = trace->ops[i].index;
+	    if (split && index % w->nthreads != w->id)
+		continue;
+	    switch (trace->ops[i].type) {
+
+	    case ALLOC: /* mm_malloc */
+		if ((p = mm_malloc(trace->ops[i].size)) == NULL)
+		    app_error("mm_malloc error in eval_mm_mt_worker");
+		w->blocks[index] = p;
+		break;
+
+	    case REALLOC: /* mm_realloc */
+		if ((p = mm_realloc(w->blocks[index], trace->ops[i].size)) == NULL)
+		    app_error("mm_realloc error in eval_mm_mt_worker");
+		w->blocks[index] = p;
+		break;
+
+	    case FREE: /* mm_free, or by the next thread when split */
+		if (split) {
+		    w->freed[w->nfreed++] = w->blocks[index];
+		    continue;
+		}
+		mm_free(w->blocks[index]);
+		break;
+
+	    default:
+		app_error("Nonexistent request type in eval_mm_mt_worker");
+	    }
+	    w->ops++;
+	}
+	if (split) {
+	    pthread_barrier_wait(w->round);
+	    for (j = 0; j < w->prev->nfreed; j++)
+		mm_free(w->prev->freed[j]);
+	    w->ops += w->prev->nfreed;
+	    w->prev->nfreed = 0;
+	    pthread_barrier_wait(w->round);
+	}
+    }
+    gettimeofday(&w->t1, NULL);
+    return NULL;
+}
+#endif
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -991,18 +1957,111 @@ void malloc_error(int tracenum, int opnum, char *msg)
     printf("ERROR [trace %d, line %d]: %s\n", tracenum, LINENUM(opnum), msg);
 }
 
+/*
+ * lat_record - Count one request that took cycles in hist
+ */
+static void lat_record(lat_hist_t *hist, unsigned long long cycles)
+{
+    int bucket = cycles;
+
+    if (cycles >= (1 << LAT_SUB_BITS)) {
+	int e = 63 - __builtin_clzll(cycles);
+	bucket = ((e - LAT_SUB_BITS + 1) << LAT_SUB_BITS) +
+	    (int)((cycles >> (e - LAT_SUB_BITS)) & ((1 << LAT_SUB_BITS) - 1));
+    }
+    hist->buckets[bucket]++;
+    hist->count++;
+    if (cycles > hist->max)
+	hist->max = cycles;
+}
+
+/*
+ * lat_percentile - Latency that fraction p of the requests in hist did
+ *     not exceed, rounded up to the end of its bucket
+ */
+static unsigned long long lat_percentile(const lat_hist_t *hist, double p)
+{
+    unsigned long seen = 0, rank = (unsigned long)(p * hist->count + 0.5);
+    int bucket, e;
+    unsigned long long upper;
+
+    if (rank < 1)
+	rank = 1;
+    for (bucket = 0; bucket < LAT_BUCKETS; bucket++) {
+	seen += hist->buckets[bucket];
+	if (seen >= rank)
+	    break;
+    }
+    if (bucket < (1 << LAT_SUB_BITS))
+	upper = bucket;
+    else {
+	e = (bucket >> LAT_SUB_BITS) + LAT_SUB_BITS - 1;
+	upper = ((unsigned long long)((1 << LAT_SUB_BITS) |
+				      (bucket & ((1 << LAT_SUB_BITS) - 1)))
+		 << (e - LAT_SUB_BITS)) + (1ULL << (e - LAT_SUB_BITS)) - 1;
+    }
+    return upper < hist->max ? upper : hist->max;
+}
+
+/*
+ * print_latency - Print the latency percentiles of each request type
+ *     in each trace, and write them to csv too unless it is NULL
+ */
+static void print_latency(int n, char **tracefiles, lat_hist_t *hists, FILE *csv)
+{
+    static char *opnames[] = {"malloc", "free", "realloc"};
+    int i, t;
+
+    printf("%5s%9s%9s%8s%8s%8s%10s\n", 
+	   "trace", "op", "count", "p50", "p99", "p99.9", "max");
+    if (csv != NULL)
+	fprintf(csv, "trace,file,op,count,p50,p99,p99.9,max\n");
+    for (i = 0; i < n; i++) {
+	for (t = 0; t < 3; t++) {
+	    lat_hist_t *hist = &hists[3*i + t];
+	    if (hist->count == 0)
+		continue;
+	    printf("%2d%12s%9lu%8llu%8llu%8llu%10llu\n", i, opnames[t],
+		   hist->count, lat_percentile(hist, 0.5),
+		   lat_percentile(hist, 0.99), lat_percentile(hist, 0.999),
+		   hist->max);
+	    if (csv != NULL)
+		fprintf(csv, "%d,%s,%s,%lu,%llu,%llu,%llu,%llu\n", i,
+			tracefiles[i], opnames[t], hist->count,
+			lat_percentile(hist, 0.5), lat_percentile(hist, 0.99),
+			lat_percentile(hist, 0.999), hist->max);
+	}
+    }
+}
+
 /* 
  * usage - Explain the command line arguments
  */
 static void usage(void) 
 {
-    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+    fprintf(stderr, "Usage: mdriver [-hvValLB] [-c|-C <n>] [-f <file>] [-t <dir>] [-m <file>]\n"
+	    "               [-F <file>] [-M <file>] [-s <n>]\n");
     fprintf(stderr, "Options\n");
-    fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
+    fprintf(stderr, "\t-B         Also time a replay that batches runs of requests.\n");
+    fprintf(stderr, "\t-c <n>     Check the free lists every <n> requests.\n");
+    fprintf(stderr, "\t-C <n>     Check the whole heap every <n> requests.\n");
+    fprintf(stderr, "\t-f <file>  Use <file> as the trace file, a .rep or made by rep2bin.\n");
+    fprintf(stderr, "\t-F <file>  Write the heap size, live bytes and free chunks over each\n"
+	    "\t           trace to <file> as CSV.\n");
     fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-L         Print latency percentiles of each request type.\n");
+    fprintf(stderr, "\t-m <file>  Like -L, also writing the percentiles to <file> as CSV.\n");
+    fprintf(stderr, "\t-M <file>  Write the counters of mm_stats over each trace to <file>\n"
+	    "\t           as CSV.\n");
+    fprintf(stderr, "\t-s <n>     With -F or -M, sample every <n> requests instead of 1%%\n"
+	    "\t           of them.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
+#ifdef MM_THREADS
+    fprintf(stderr, "\t-S         With -T, split each trace across the threads.\n");
+    fprintf(stderr, "\t-T <n>     Also replay each trace on 1 to <n> threads at once.\n");
+#endif
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
 }
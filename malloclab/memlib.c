@@ -2,9 +2,24 @@
  * memlib.c - a module that simulates the memory system.  Needed because it 
  *            allows us to interleave calls from the student's malloc package 
  *            with the system's malloc package in libc.
+ *
+ * By default the heap lives in one MAX_HEAP block from malloc. Built with
+ * MEM_USE_MMAP it lives in an MMAP_RESERVE range of address space that is
+ * reserved without access at startup, made accessible as the break moves
+ * up, and whose pages are handed back to the system when the heap shrinks
+ * or the allocator reports them unused through mem_release.
+ *
+ * Either way the heap starts out zeroed, and memlib keeps track of the
+ * address from which on it still is, see mem_zero_lo.
+ *
+ * Apart from the heap, the allocator can get regions of their own from
+ * mem_map. They are counted in the footprint and all unmapped when the
+ * heap is reset.
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <assert.h>
 #include <unistd.h>
 #include <sys/mman.h>
@@ -29,20 +44,74 @@ bool is_aligned(char *p) {
 static char *mem_start_brk;  /* points to first byte of heap */
 static char *mem_brk;        /* points to last byte of heap */
 static char *mem_max_addr;   /* largest legal heap address */ 
+static size_t mem_peak_size; /* largest heap plus mapped size since the last reset */
+static char *mem_zero_brk;   /* the heap reads as zero from here on */
+#ifdef MEM_USE_MMAP
+static char *mem_commit_end; /* end of the part of the reservation made accessible */
+#endif
+
+/*
+ * Regions handed out by mem_map, hashed on the MEM_GRANULE byte granules of
+ * the address space they cover. A region is linked into the bucket of every
+ * granule it overlaps, so the region holding an address is found among the
+ * few in the bucket of that address's granule.
+ */
+#define MEM_GRANULE_SHIFT 20       /* granules of 1 MB */
+#define MEM_BUCKETS       1024
+
+typedef struct mem_region mem_region;
+
+/* the link of a region into the bucket of one granule it covers */
+typedef struct mem_link {
+    mem_region *region;
+    struct mem_link *next;
+} mem_link;
+
+struct mem_region {
+    char *addr;
+    size_t len;
+    size_t nlinks;
+    mem_link links[];              /* one per granule covered */
+};
+static mem_link *mem_buckets[MEM_BUCKETS];
+static size_t mem_mapped_size; /* bytes in all regions */
+
+/* records the current footprint if it is the largest so far */
+static void mem_update_peak(void)
+{
+    size_t size = (size_t)(mem_brk - mem_start_brk) + mem_mapped_size;
+    if (size > mem_peak_size)
+	mem_peak_size = size;
+}
 
 /* 
  * mem_init - initialize the memory system model
  */
 void mem_init(void)
 {
+#ifdef MEM_USE_MMAP
+    /* reserve the address space, pages are committed by mem_sbrk */
+    mem_start_brk = mmap(NULL, MMAP_RESERVE, PROT_NONE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem_start_brk == MAP_FAILED) {
+	fprintf(stderr, "mem_init_vm: mmap error\n");
+	exit(1);
+    }
+
+    mem_max_addr = mem_start_brk + MMAP_RESERVE;
+    mem_commit_end = mem_start_brk;
+#else
     /* allocate the storage we will use to model the available VM */
-    if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
+    if ((mem_start_brk = (char *)calloc(1, MAX_HEAP)) == NULL) {
 	fprintf(stderr, "mem_init_vm: malloc error\n");
 	exit(1);
     }
 
     mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
+#endif
     mem_brk = mem_start_brk;                  /* heap is empty initially */
+    mem_zero_brk = mem_start_brk;
+    mem_peak_size = 0;
 }
 
 /* 
@@ -50,7 +119,12 @@ void mem_init(void)
  */
 void mem_deinit(void)
 {
+    mem_reset_brk();
+#ifdef MEM_USE_MMAP
+    munmap(mem_start_brk, MMAP_RESERVE);
+#else
     free(mem_start_brk);
+#endif
 }
 
 /*
@@ -58,27 +132,196 @@ void mem_deinit(void)
  */
 void mem_reset_brk()
 {
+    for (int i = 0; i < MEM_BUCKETS; i++) {
+	while (mem_buckets[i] != NULL)
+	    mem_unmap(mem_buckets[i]->region->addr,
+		      mem_buckets[i]->region->len);
+    }
     mem_brk = mem_start_brk;
+    mem_peak_size = 0;
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    by incr bytes and returns the start address of the new area. A
+ *    negative incr shrinks the heap, but never below its first byte.
  */
-void *mem_sbrk(int incr) 
+void *mem_sbrk(intptr_t incr) 
 {
     char *old_brk = mem_brk;
 
-    if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+    /* compared as distances, so that no increment moves a pointer out of the heap */
+    if (incr < 0 && -incr > mem_brk - mem_start_brk) {
+	errno = EINVAL;
+	fprintf(stderr, "ERROR: mem_sbrk failed. Shrunk below the heap start...\n");
+	return (void *)-1;
+    }
+    if (incr > mem_max_addr - mem_brk) {
 	errno = ENOMEM;
 	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
 	return (void *)-1;
     }
+#ifdef MEM_USE_MMAP
+    if (mem_brk + incr > mem_commit_end) {
+	/* commit whole units past the new break */
+	size_t need = mem_brk + incr - mem_start_brk;
+	char *end = mem_start_brk + (need + MEM_COMMIT_UNIT - 1) / MEM_COMMIT_UNIT * MEM_COMMIT_UNIT;
+	if (end > mem_max_addr)
+	    end = mem_max_addr;
+	if (mprotect(mem_commit_end, end - mem_commit_end, PROT_READ | PROT_WRITE) < 0) {
+	    errno = ENOMEM;
+	    fprintf(stderr, "ERROR: mem_sbrk failed. Could not commit memory...\n");
+	    return (void *)-1;
+	}
+	mem_commit_end = end;
+    }
+    if (incr < 0) {
+	/* everything past the break is released, so it reads as zero again */
+	uintptr_t page = mem_pagesize();
+	char *end = mem_zero_brk > mem_brk ? mem_zero_brk : mem_brk;
+	mem_release(mem_brk + incr, end - (mem_brk + incr) + page - 1);
+	mem_zero_brk = (char *)(((uintptr_t)(mem_brk + incr) + page - 1) & ~(page - 1));
+    }
+#endif
     mem_brk += incr;
+    if (mem_brk > mem_zero_brk)
+	mem_zero_brk = mem_brk;
+    mem_update_peak();
     return (void *)old_brk;
 }
 
+/* returns the size of a region record with room for the links of len bytes */
+static size_t mem_region_size(size_t len)
+{
+    /* len bytes overlap at most this many granules, however they lie */
+    return sizeof(mem_region) +
+	(((len - 1) >> MEM_GRANULE_SHIFT) + 2) * sizeof(mem_link);
+}
+
+/* links region r into the buckets of the granules it covers */
+static void mem_hash(mem_region *r)
+{
+    uintptr_t lo = (uintptr_t)r->addr >> MEM_GRANULE_SHIFT;
+    uintptr_t hi = ((uintptr_t)r->addr + r->len - 1) >> MEM_GRANULE_SHIFT;
+
+    r->nlinks = hi - lo + 1;
+    for (size_t i = 0; i < r->nlinks; i++) {
+	mem_link **bucket = &mem_buckets[(lo + i) % MEM_BUCKETS];
+	r->links[i].region = r;
+	r->links[i].next = *bucket;
+	*bucket = &r->links[i];
+    }
+}
+
+/* takes region r out of the buckets mem_hash linked it into */
+static void mem_unhash(mem_region *r)
+{
+    uintptr_t lo = (uintptr_t)r->addr >> MEM_GRANULE_SHIFT;
+
+    for (size_t i = 0; i < r->nlinks; i++) {
+	mem_link **link = &mem_buckets[(lo + i) % MEM_BUCKETS];
+	while (*link != &r->links[i])
+	    link = &(*link)->next;
+	*link = r->links[i].next;
+    }
+}
+
+/* returns the region holding the byte at addr, or NULL if none does */
+static mem_region *mem_region_at(void *addr)
+{
+    uintptr_t g = (uintptr_t)addr >> MEM_GRANULE_SHIFT;
+
+    for (mem_link *l = mem_buckets[g % MEM_BUCKETS]; l != NULL; l = l->next) {
+	mem_region *r = l->region;
+	if ((char *)addr >= r->addr && (char *)addr < r->addr + r->len)
+	    return r;
+    }
+    return NULL;
+}
+
+/*
+ * mem_map - returns a new region of len bytes outside the heap, aligned
+ *    to the page size, or NULL when the system has no memory for it
+ */
+void *mem_map(size_t len)
+{
+    mem_region *r = malloc(mem_region_size(len));
+    if (r == NULL)
+	return NULL;
+    r->addr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (r->addr == MAP_FAILED) {
+	free(r);
+	return NULL;
+    }
+    r->len = len;
+    mem_hash(r);
+    mem_mapped_size += len;
+    mem_update_peak();
+    return r->addr;
+}
+
+/* returns the region starting at addr */
+static mem_region *mem_find_region(void *addr)
+{
+    mem_region *r = mem_region_at(addr);
+    assert(r != NULL && r->addr == addr);
+    return r;
+}
+
+/*
+ * mem_remap - resizes the region at addr from mem_map to len bytes,
+ *    possibly moving it; returns its address or NULL on failure, in
+ *    which case the region is left as it was
+ */
+void *mem_remap(void *addr, size_t len)
+{
+    mem_region *r = mem_find_region(addr);
+    mem_region *grown;
+    char *p;
+
+    /* the record must hold the links of the region before and after */
+    mem_unhash(r);
+    grown = realloc(r, mem_region_size(len > r->len ? len : r->len));
+    if (grown == NULL) {
+	mem_hash(r);
+	return NULL;
+    }
+    r = grown;
+    p = mremap(r->addr, r->len, len, MREMAP_MAYMOVE);
+    if (p != MAP_FAILED) {
+	mem_mapped_size += len - r->len;
+	r->addr = p;
+	r->len = len;
+	mem_update_peak();
+    }
+    mem_hash(r);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+/*
+ * mem_unmap - gives the region at addr from mem_map back to the system
+ */
+void mem_unmap(void *addr, size_t len)
+{
+    mem_region *r = mem_find_region(addr);
+    assert(r->len == len);
+    mem_unhash(r);
+    munmap(r->addr, r->len);
+    mem_mapped_size -= r->len;
+    free(r);
+}
+
+/*
+ * mem_is_mapped - returns whether [lo, hi] lies within a single region
+ *    from mem_map
+ */
+bool mem_is_mapped(void *lo, void *hi)
+{
+    mem_region *r = mem_region_at(lo);
+    return r != NULL && (char *)hi < r->addr + r->len;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -103,6 +346,51 @@ size_t mem_heapsize()
     return (size_t)(mem_brk - mem_start_brk);
 }
 
+/*
+ * mem_zero_lo() - returns the address from which on the heap reads as
+ *    zero: the part of the next mem_sbrk at or above it comes zeroed,
+ *    as do the regions from mem_map
+ */
+void *mem_zero_lo()
+{
+    return (void *)mem_zero_brk;
+}
+
+/*
+ * mem_mapsize() - returns the bytes in all regions from mem_map
+ */
+size_t mem_mapsize()
+{
+    return mem_mapped_size;
+}
+
+/*
+ * mem_release - tells the system that the pages lying entirely within
+ *    [addr, addr + len) hold nothing the allocator needs. The mmap backend
+ *    gives them back, they read as zero when next touched. The malloc
+ *    backend keeps them as they are.
+ */
+void mem_release(void *addr, size_t len)
+{
+#ifdef MEM_USE_MMAP
+    uintptr_t page = mem_pagesize();
+    uintptr_t lo = ((uintptr_t)addr + page - 1) & ~(page - 1);
+    uintptr_t hi = ((uintptr_t)addr + len) & ~(page - 1);
+    if (hi > lo)
+	madvise((void *)lo, hi - lo, MADV_DONTNEED);
+#endif
+}
+
+/*
+ * mem_peak_heapsize() - returns the largest heap size in bytes since the
+ *    heap was last reset, mapped regions included; the heap may have been
+ *    shrunk and regions unmapped since
+ */
+size_t mem_peak_heapsize()
+{
+    return mem_peak_size;
+}
+
 /*
  * mem_pagesize() - returns the page size of the system
  */
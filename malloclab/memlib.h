@@ -1,13 +1,22 @@
 #include <unistd.h>
+#include <stdint.h>
 #include <stdbool.h>
 
 // you may use these functions in mm.c
-void *mem_sbrk(int incr);
+void *mem_sbrk(intptr_t incr);
 void mem_reset_brk(void); 
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
+size_t mem_mapsize(void);
+void *mem_zero_lo(void);
+size_t mem_peak_heapsize(void);
 size_t mem_pagesize(void);
+void mem_release(void *addr, size_t len);
+void *mem_map(size_t len);
+void *mem_remap(void *addr, size_t len);
+void mem_unmap(void *addr, size_t len);
+bool mem_is_mapped(void *lo, void *hi);
 
 // you may also use these helper functions in mm.c
 #define ALIGNMENT 16
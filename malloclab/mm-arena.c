@@ -0,0 +1,160 @@
+/*
+ * Region allocator on top of mm_malloc, for memory whose objects all die together. A region
+ * (mm_arena_t, not to be confused with the arenas inside mm.c) hands out objects by bumping a
+ * pointer through blocks it gets from mm_malloc, and frees them all at once.
+ *
+ * The region header lives at the start of its first block, behind the block header, so creating
+ * a region is a single mm_malloc. Blocks are chained in the order they were added. Reset goes
+ * back to the start of the first block and keeps the others, which are bumped through again
+ * before any new block is allocated, so a region used for one request after the other settles
+ * at the blocks its largest request needs and reset costs a few stores. Objects larger than a
+ * quarter of a block get a block of their own on a separate list, which reset frees, so that
+ * they neither waste the rest of a block nor stay allocated across resets.
+ *
+ * Objects are aligned to ALIGNMENT and cannot be freed or resized one by one. A region must only
+ * be used by one thread at a time, the blocks come from mm_malloc and are as thread-safe as it is.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+//block size of regions created with a block size of 0, small enough to stay in the heap
+#define DEFAULT_REGION_BLOCK (64 * 1024)
+
+//Header of every block of a region, followed by its objects. Objects start ALIGNMENT aligned
+//as long as the header size is a multiple of it.
+typedef struct region_block {
+	struct region_block *next;
+	size_t size;
+} region_block;
+
+//blocks is the chain the objects are bumped out of, current the one ptr and end point into.
+//large holds the blocks of objects too large for that.
+struct mm_arena {
+	region_block *blocks;
+	region_block *current;
+	char *ptr;
+	char *end;
+	region_block *large;
+	size_t block_size;
+};
+
+//bytes of the region header at the start of the first block
+#define REGION_SIZE ((sizeof(mm_arena_t) + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1))
+
+//returns the first byte of block b after its header
+static char *block_start(region_block *b) {
+	return (char *)b + sizeof(region_block);
+}
+
+//returns a new block of size bytes after its header, NULL when mm_malloc fails
+static region_block *new_block(size_t size) {
+	region_block *b = mm_malloc(sizeof(region_block) + size);
+	if (b == NULL) return NULL;
+	b->next = NULL;
+	b->size = size;
+	return b;
+}
+
+//makes b, a block of the chain, the one objects are bumped out of, from its first byte on
+//the region header in the first block is skipped
+static void enter_block(mm_arena_t *arena, region_block *b) {
+	arena->current = b;
+	arena->ptr = block_start(b) + (b == arena->blocks ? REGION_SIZE : 0);
+	arena->end = block_start(b) + b->size;
+}
+
+//frees the blocks of large objects
+static void free_large(mm_arena_t *arena) {
+	region_block *b = arena->large;
+	while (b != NULL) {
+		region_block *nxt = b->next;
+		mm_free(b);
+		b = nxt;
+	}
+	arena->large = NULL;
+}
+
+/*
+ * mm_arena_create returns an empty region whose blocks hold block_size bytes each, 0 for the
+ * default, or NULL when mm_malloc fails
+ */
+mm_arena_t *mm_arena_create(size_t block_size)
+{
+	if (block_size == 0) block_size = DEFAULT_REGION_BLOCK;
+	if (block_size > SIZE_MAX / 2) return NULL;
+	block_size = align(block_size);
+	if (block_size < 4 * REGION_SIZE) block_size = 4 * REGION_SIZE;
+
+	region_block *first = new_block(block_size);
+	if (first == NULL) return NULL;
+	mm_arena_t *arena = (mm_arena_t *)block_start(first);
+	arena->blocks = first;
+	arena->large = NULL;
+	arena->block_size = block_size;
+	enter_block(arena, first);
+	return arena;
+}
+
+/*
+ * mm_arena_alloc returns size bytes from the region, NULL for 0 bytes or when mm_malloc fails.
+ * While the current block has room that is all it does. Otherwise the next block of the chain,
+ * kept from before the last reset or added now, becomes the current one, unless the object is
+ * large and gets a block of its own.
+ */
+void *mm_arena_alloc(mm_arena_t *arena, size_t size)
+{
+	if (size == 0 || size > SIZE_MAX / 2) return NULL;
+	size = align(size);
+	if (size <= (size_t)(arena->end - arena->ptr)) {
+		void *p = arena->ptr;
+		arena->ptr += size;
+		return p;
+	}
+	if (size > arena->block_size / 4) {
+		region_block *b = new_block(size);
+		if (b == NULL) return NULL;
+		b->next = arena->large;
+		arena->large = b;
+		return block_start(b);
+	}
+
+	region_block *b = arena->current->next;
+	if (b == NULL) {
+		if ((b = new_block(arena->block_size)) == NULL) return NULL;
+		arena->current->next = b;
+	}
+	enter_block(arena, b);
+	void *p = arena->ptr;
+	arena->ptr += size;
+	return p;
+}
+
+/*
+ * mm_arena_reset frees every object of the region at once. The blocks are kept for the objects
+ * allocated next, only those of large objects are freed.
+ */
+void mm_arena_reset(mm_arena_t *arena)
+{
+	if (arena->large != NULL) free_large(arena);
+	enter_block(arena, arena->blocks);
+}
+
+/*
+ * mm_arena_destroy frees the region with all of its blocks
+ */
+void mm_arena_destroy(mm_arena_t *arena)
+{
+	free_large(arena);
+	region_block *b = arena->blocks->next;
+	region_block *first = arena->blocks;
+	while (b != NULL) {
+		region_block *nxt = b->next;
+		mm_free(b);
+		b = nxt;
+	}
+	mm_free(first);
+}
@@ -13,6 +13,7 @@
 #include <assert.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdint.h>
 
 #include "mm.h"
 #include "memlib.h"
@@ -87,6 +88,70 @@ void *mm_malloc(size_t size)
 	mm_checkheap(0);
 }
 
+/*
+ * mm_malloc_batch - Allocate the blocks one by one
+ */
+size_t mm_malloc_batch(size_t size, size_t n, void **out)
+{
+	size_t got;
+	for (got = 0; got < n; got++)
+		if ((out[got] = mm_malloc(size)) == NULL)
+			break;
+	return got;
+}
+
+/*
+ * mm_free_batch - Free the blocks one by one
+ */
+void mm_free_batch(void **ptrs, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		if (ptrs[i] != NULL)
+			mm_free(ptrs[i]);
+}
+
+/*
+ * mm_calloc - Allocate a block with mm_malloc and clear it
+ */
+void *mm_calloc(size_t nmemb, size_t size)
+{
+	size_t bytes;
+	if (__builtin_mul_overflow(nmemb, size, &bytes))
+		return NULL;
+	void *p = mm_malloc(bytes);
+	if (p != NULL)
+		memset(p, 0, bytes);
+	return p;
+}
+
+/*
+ * mm_memalign - Pad the heap with a free chunk until the next block is
+ *     aligned, then allocate it like mm_malloc
+ */
+void *mm_memalign(size_t alignment, size_t size)
+{
+	if (alignment & (alignment - 1))
+		alignment = (size_t)1 << (64 - __builtin_clzl(alignment));
+	if (alignment > ALIGNMENT) {
+		uintptr_t p = (uintptr_t)mem_heap_hi() + 1 + sizeof(header);
+		size_t lead = (alignment - p % alignment) % alignment;
+		if (lead > 0) {
+			header *h = mem_sbrk(lead);
+			if (h == (void *)-1)
+				return NULL;
+			set_chunk_size_status(h, lead, false);
+		}
+	}
+	return mm_malloc(size);
+}
+
+void *mm_aligned_alloc(size_t alignment, size_t size)
+{
+	if (alignment == 0 || (alignment & (alignment - 1)))
+		return NULL;
+	return mm_memalign(alignment, size);
+}
+
 /*
  * mm_free - Freeing a block clears the status in implicit header
  */
@@ -100,6 +165,22 @@ void mm_free(void *ptr)
 	mm_checkheap(0);
 }
 
+/*
+ * mm_free_sized - The size is not needed to free a block
+ */
+void mm_free_sized(void *ptr, size_t size)
+{
+	mm_free(ptr);
+}
+
+/*
+ * mm_usable_size - The whole payload of the chunk
+ */
+size_t mm_usable_size(void *ptr)
+{
+	return get_chunk_size(payload_to_header(ptr)) - sizeof(header);
+}
+
 /*
  * mm_realloc - Implemented simply in terms of mm_malloc and mm_free
  */
@@ -128,6 +209,62 @@ void *mm_realloc(void *ptr, size_t size)
 }
 
 
+/*
+ * mm_validate - The chunks must tile the heap, there are no free lists to check
+ */
+const char *mm_validate(int mode)
+{
+	header *h = mem_heap_lo();
+	while ((void *)h < mem_heap_hi()) {
+		size_t size = get_chunk_size(h);
+		if (size < sizeof(header) || size % ALIGNMENT != 0 ||
+		    size > (size_t)((char *)mem_heap_hi() + 1 - (char *)h))
+			return "chunks do not tile the heap";
+		h = get_next_chunk(h);
+	}
+	return NULL;
+}
+
+/*
+ * mm_heapinfo - Freed chunks are never reused but still lie in the heap,
+ *     so they are reported as its free chunks
+ */
+void mm_heapinfo(mm_heapinfo_t *info)
+{
+	header *h = mem_heap_lo();
+	memset(info, 0, sizeof(*info));
+	while ((void *)h < mem_heap_hi()) {
+		size_t size = get_chunk_size(h);
+		if (!get_chunk_status(h)) {
+			info->free_bytes += size;
+			info->free_chunks++;
+			if (size > info->largest_free)
+				info->largest_free = size;
+		}
+		h = get_next_chunk(h);
+	}
+}
+
+/*
+ * mm_stats - No counters are kept, so only the live bytes, the heap size
+ *     and the free chunks are filled in, found by walking the heap. There
+ *     are no bins, every free chunk is counted in the last entry.
+ */
+void mm_stats(mm_stats_t *stats)
+{
+	header *h = mem_heap_lo();
+	memset(stats, 0, sizeof(*stats));
+	stats->heap_size = mem_heapsize();
+	while ((void *)h < mem_heap_hi()) {
+		if (get_chunk_status(h))
+			stats->live_bytes += get_chunk_size(h) - sizeof(header);
+		else
+			stats->bin_chunks[MM_STATS_BINS - 1]++;
+		h = get_next_chunk(h);
+	}
+}
+
+
 void mm_checkheap(int verbose_level) 
 {
 	size_t total_allocated = 0, total_free = 0;
@@ -1,76 +1,370 @@
 /*
- * Malloc implementation consists of two explicit lists. One to keep track of the allocated memory
- * and one to keep track of the freed memory. Essentially, first the program looks in the freed list to see 
- * a chunk can be found that is relatively similar in size as not to waste memory allocating a big chunk for
- * only a small request. However, if nothing is found in the free list, sbrk is called and the memory is 
- * given directly from the system. The average of the test cases given is 70.9% in relation to the system malloc.
+ * Malloc implementation keeps small free chunks in an array of segregated free lists (bins), one
+ * per chunk size below LARGE_CHUNK. A bitmap records which bins are non-empty, so every chunk in
+ * a bin fits a request of that size and the smallest one that can hold it is found with a single
+ * find-first-set. Larger free chunks are kept in a treap ordered by size and address, where the
+ * best fit for a request is found in O(log n). If neither can satisfy the request, sbrk is
+ * called and the memory is given directly from the system.
+ *
+ * Every chunk starts with a single header word holding its size, whether it is allocated and
+ * whether the chunk physically before it is allocated. Allocated chunks carry nothing else, the
+ * payload starts right after that word. Only free chunks use their payload for the bin links and
+ * end in a footer (boundary tag) repeating their size, so a freed chunk finds both of its physical
+ * neighbours in constant time and is merged with whichever of them are free before it is binned.
+ *
+ * The bins and the top of the heap belong to an arena. The heap is carved into extents, each
+ * framed by an 8 byte pad, which puts every payload on an ALIGNMENT boundary, and an allocated,
+ * zero sized epilogue header, so chunks never merge across extents. An arena grows its current
+ * extent while nobody else has moved the break past it and starts a new extent otherwise. The
+ * single-threaded build has one arena, which only ever has one extent. Once the free memory at
+ * the top of an extent that ends at the break reaches the trim threshold, free moves the break
+ * back down so the heap follows what is actually in use.
+ *
+ * Requests of up to SLAB_MAX_OBJECT bytes do not get chunks of their own. They are carved out
+ * of slabs, SLAB_SIZE chunks whose payload starts a SLAB_SIZE aligned page with a slab header
+ * followed by equally sized objects. A bitmap in the slab header marks the free objects, so an object is
+ * found with a find-first-set and costs a bit instead of a header. Each arena keeps, per object
+ * size, a list of its slabs that still have free objects. Slabs that become empty are kept for
+ * any size until the arena would otherwise have to grow, then their chunks go to the bins. A
+ * bitmap over the heap marks which pages are slabs, so free finds the slab of a pointer by
+ * rounding it down to its page.
+ *
+ * Requests whose chunks would be HUGE_CHUNK bytes or more stay out of the heap altogether. Each
+ * gets a region of its own from mem_map, laid out like an extent with the 8 byte pad in front and
+ * room for an epilogue at the end, and a header with the HUGE_BIT set. Blocks aligned to more than
+ * ALIGNMENT by mm_memalign have a longer pad instead. Free unmaps the region at once and realloc resizes it
+ * with mem_remap, so huge blocks neither split free chunks nor hold the break up.
+ *
+ * Built with MM_THREADS the allocator is thread-safe. Threads are spread over NUM_ARENAS arenas,
+ * each with its own lock, and the break is moved under a separate lock. Every header records its
+ * arena in the high bits. A block freed by a thread that does not own its arena is pushed on that
+ * arena's lock-free remote-free stack, which the owner drains in one go the next time it takes its
+ * lock. In front of its arena each thread keeps a small cache of chunks and slab objects per
+ * size class. Cached blocks stay marked allocated in the heap, so malloc and free of small blocks touch only the
+ * calling thread's cache; the arena lock is taken to refill an empty class or flush a full one in
+ * batches.
  */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <unistd.h>
 #include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#ifdef MM_THREADS
+#include <pthread.h>
+#endif
 
 #include "mm.h"
 #include "memlib.h"
+#include "config.h"
 
-#define MIN_GUARD 1024
+//free chunks of at least this many bytes go to the size-ordered tree instead of a bin
+#define LARGE_CHUNK 1024
+//free runs of at least this many bytes have their pages handed back through mem_release
+#define RELEASE_RUN (1024 * 1024)
+//chunks of at least this many bytes are mapped on their own instead of living in the heap
+#define HUGE_CHUNK (128 * 1024)
 
-//Node stucture for doubly linked list
+//low bits of the header word, chunk sizes are multiples of ALIGNMENT so they are always zero
+#define ALLOC_BIT 0x1
+#define PREV_ALLOC_BIT 0x2
+#define HUGE_BIT 0x4
+//set on free chunks whose payload is known to be zero apart from the links and the footer
+#define ZERO_BIT 0x8
+#define STATUS_MASK ((size_t)(ALIGNMENT-1))
+
+//high bits of the header word hold the index of the chunk's arena
+#define ARENA_SHIFT 48
+#define ARENA_BITS (~(size_t)0 << ARENA_SHIFT)
+#define SIZE_MASK (~ARENA_BITS & ~STATUS_MASK)
+
+//Chunk layout. Only size_n_status is present in allocated chunks, next and prev
+//overlay the first bytes of the payload and are only valid while the chunk is free.
 typedef struct header {
-	size_t size;
+	size_t size_n_status;
 	struct header *next;
 	struct header *prev;
-	size_t status;  
 } header;
 
+//boundary tag at the end of every free chunk, holds the chunk size
+typedef size_t footer;
+
+//bytes in front of every payload
+#define HEADER_SIZE offsetof(header, next)
+
+//Large free chunks in the tree, the same words as header with the links used as children.
+//Nodes are ordered by size and then address and heap ordered by tree_priority.
+typedef struct tree_node {
+	size_t size_n_status;
+	struct tree_node *left;
+	struct tree_node *right;
+} tree_node;
+
+//smallest chunk that can be free: the header, both links and a footer
+#define MIN_CHUNK (sizeof(header) + sizeof(footer))
+
+//bytes at the start of a payload the links of a free chunk or tree node overwrite
+#define LINKS_SIZE (sizeof(header) - HEADER_SIZE)
+
+//number of segregated free lists, bin i holds chunks of exactly MIN_CHUNK + i*ALIGNMENT bytes
+#define NUM_BINS ((LARGE_CHUNK - MIN_CHUNK) / ALIGNMENT)
+
+//Placement policies of find_memory, one is chosen with -DMM_POLICY=<name> (see the Makefile's
+//policies target). BEST_FIT takes the smallest chunk that fits. GOOD_FIT stops looking in the
+//tree at the first chunk at most GOOD_FIT_GUARD bytes too large. FIRST_FIT takes the lowest
+//addressed chunk that fits and NEXT_FIT the lowest one after the chunk placed last, wrapping
+//around; both look at every free chunk that fits. LIFO_FIT reuses the chunk freed last when it
+//fits and falls back to BEST_FIT.
+#define BEST_FIT 0
+#define GOOD_FIT 1
+#define FIRST_FIT 2
+#define NEXT_FIT 3
+#define LIFO_FIT 4
+#ifndef MM_POLICY
+#define MM_POLICY BEST_FIT
+#endif
+#ifndef GOOD_FIT_GUARD
+#define GOOD_FIT_GUARD 256
+#endif
+
+#ifdef MM_THREADS
+//arenas threads are spread over, at most 1 << (64 - ARENA_SHIFT)
+#define NUM_ARENAS 16
+//smallest extent an arena starts once another arena has grown past its first one,
+//so that arenas do not interleave chunk by chunk
+#define MIN_EXTENT (64 * 1024)
+#else
+#define NUM_ARENAS 1
+#define MIN_EXTENT 0
+#endif
+
+//default for the trim threshold set by mm_set_trim_threshold
+#define DEFAULT_TRIM_THRESHOLD (128 * 1024)
+
+//requests of up to SLAB_MAX_OBJECT bytes are served from slabs of SLAB_SIZE bytes,
+//slab class i holds objects of (i + 1) * ALIGNMENT bytes
+#define SLAB_SIZE 4096
+#define SLAB_MAX_OBJECT 256
+#define SLAB_CLASSES (SLAB_MAX_OBJECT / ALIGNMENT)
+#define SLAB_MAP_WORDS (SLAB_SIZE / ALIGNMENT / 64)
+
+//Header at the start of every slab page. free_map has a bit set for every free object,
+//next and prev link the slab into its arena's list while it has free objects.
+typedef struct slab {
+	size_t object_size;
+	struct arena *owner;
+	struct slab *next;
+	struct slab *prev;
+	int free_count;
+	int num_objects;
+	unsigned long free_map[SLAB_MAP_WORDS];
+} slab;
+
+//offset of the first object in a slab
+#define SLAB_HEADER_SIZE ((sizeof(slab) + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1))
+
+//Counters of an arena for mm_stats, kept under the arena lock. bin_chunks has an entry for
+//every bin and a last one for the tree.
+typedef struct arena_counters {
+	size_t bin_chunks[NUM_BINS + 1];
+	size_t splits;
+	size_t coalesces;
+	size_t search_steps;
+} arena_counters;
+
+//Free chunks and the growing extent of one arena. epilogue is the header at the end of
+//the extent it grows, NULL until it has one. id_bits is the arena index as stored in headers.
+typedef struct arena {
+	header *free_bins[NUM_BINS];
+	unsigned long bin_map;
+	tree_node *large_tree;
+	slab *partial_slabs[SLAB_CLASSES];
+	//slabs without allocated objects, reused by any class, linked through next
+	slab *empty_slabs;
+	header *epilogue;
+	size_t id_bits;
+	arena_counters counters;
+#if MM_POLICY == NEXT_FIT
+	//the chunk placed last, where the next search starts
+	header *rover;
+#elif MM_POLICY == LIFO_FIT
+	//the free chunk insert_free_list binned last, NULL once it left the bins
+	header *last_freed;
+#endif
+#ifdef MM_THREADS
+	pthread_mutex_t lock;
+	//blocks freed by threads that do not own the arena, linked through next
+	header *remote_frees;
+#endif
+} arena;
 
-//head reference to the allocated list
-header *global_allocated_list_head= NULL;
+arena global_arenas[NUM_ARENAS];
 
-//head reference to the free list
-header *global_free_list = NULL;
+//free memory at the top of an extent is given back to the system once it reaches this many bytes
+size_t global_trim_threshold = DEFAULT_TRIM_THRESHOLD;
+
+//Counters of the calls and the live bytes for mm_stats. Blocks are allocated and freed without
+//any lock in the thread-safe build, where every thread counts in its cache instead and
+//global_counters holds what exited threads counted and the live bytes threads published.
+typedef struct call_counters {
+	size_t live_bytes;
+	size_t peak_bytes;
+	size_t mallocs;
+	size_t frees;
+	size_t reallocs;
+} call_counters;
+
+call_counters global_counters;
+
+//largest heap of either memlib backend
+#define HEAP_LIMIT (MMAP_RESERVE > MAX_HEAP ? MMAP_RESERVE : MAX_HEAP)
+
+//One bit per SLAB_SIZE page of the heap, set while the page is a slab. The map covers the largest
+//heap there can be, but only its words below global_slab_words ever had a bit set, so the pages
+//past those are never touched and the system only maps them once the heap gets that large.
+unsigned long global_slab_pages[HEAP_LIMIT / SLAB_SIZE / 64];
+unsigned long global_slab_words = 0;
+
+#ifdef MM_THREADS
+//per-thread cache classes, class i holds chunks of at least MIN_CHUNK + i*ALIGNMENT bytes
+#define TCACHE_CLASSES 32
+//chunks a class may hold before half of them are flushed back to the bins
+#define TCACHE_MAX 32
+//chunks moved between a class and the bins under one lock acquisition
+#define TCACHE_BATCH 16
+//slab objects are cached in the classes after the chunk classes, linked through the header
+//their payload would have, of which only next is ever written
+#define TCACHE_LISTS (TCACHE_CLASSES + SLAB_CLASSES)
+
+//A thread's live bytes are added to global_counters once they moved by more than this since
+//they last were, which is when the peak is updated
+#define LIVE_STEP (64 * 1024)
+
+//A thread's arena and its cached chunks, which are linked through header->next. epoch is
+//compared to global_heap_epoch so that a cache filled before mm_init reset the heap is
+//dropped instead of reused.
+//counters are the thread's own, written only by it and read by mm_stats, which finds them
+//through next in global_tcaches. published is the part of counters.live_bytes already added
+//to global_counters.
+typedef struct tcache {
+	unsigned long epoch;
+	arena *home;
+	header *classes[TCACHE_LISTS];
+	int counts[TCACHE_LISTS];
+	call_counters counters;
+	size_t published;
+	bool listed;
+	struct tcache *next;
+} tcache;
+
+pthread_mutex_t global_brk_lock = PTHREAD_MUTEX_INITIALIZER;
+unsigned long global_heap_epoch = 0;
+unsigned long global_next_arena = 0;
+__thread tcache thread_cache;
+//the caches of the running threads, for mm_stats
+tcache *global_tcaches = NULL;
+pthread_mutex_t global_tcaches_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//flushes the cache of an exiting thread
+pthread_key_t tcache_key;
+pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+pthread_once_t arena_locks_once = PTHREAD_ONCE_INIT;
+
+#define LOCK_ARENA(a) pthread_mutex_lock(&(a)->lock)
+#define UNLOCK_ARENA(a) pthread_mutex_unlock(&(a)->lock)
+#define LOCK_BRK() pthread_mutex_lock(&global_brk_lock)
+#define UNLOCK_BRK() pthread_mutex_unlock(&global_brk_lock)
+#define COUNT(field, n) count_add(&get_tcache()->counters.field, (n))
+#else
+#define LOCK_ARENA(a)
+#define UNLOCK_ARENA(a)
+#define LOCK_BRK()
+#define UNLOCK_BRK()
+#define COUNT(field, n) (global_counters.field += (n))
+#endif
 
 //function to quickly and easily add/remove asserts
 void my_assert(bool condition) {
 	//assert(condition);
 }
 
-//function from naive changed to represent my header struct
-//Easily sets size and status(allocated or freed) of a given chunk
+//fucntion returns the size of a chunk given header pointer
+size_t get_chunk_size(header *hdr)
+{
+	return hdr->size_n_status & SIZE_MASK;
+}
+
+//function from naive which will return the status of a chunk given the header(useful for checks)
+bool get_chunk_status(header *hdr)
+{
+	return hdr->size_n_status & ALLOC_BIT;
+}
+
+//returns the status of the chunk physically before hdr
+bool get_prev_status(header *hdr)
+{
+	return hdr->size_n_status & PREV_ALLOC_BIT;
+}
+
+//returns the boundary tag at the end of a chunk of the given size
+footer *header_to_footer(header *hdr, size_t size)
+{
+	return (footer *)((char *)hdr + size - sizeof(footer));
+}
+
+//Easily sets size and status(allocated or freed) of a given chunk, keeping its arena and the
+//status of the previous chunk. Free chunks also get their footer written.
 void set_chunk_size_status(header *hdr, size_t size, bool status)
 {
-	hdr->size = size;
-	hdr->status = status;
+	hdr->size_n_status = size | (hdr->size_n_status & (ARENA_BITS | PREV_ALLOC_BIT)) | (size_t)status;
+	if (!status) *header_to_footer(hdr, size) = size;
 }
 
-//function from naive which only resets the status given the header pointer
-void set_chunk_status(header *hdr, bool status)
+//records in hdr whether the chunk physically before it is allocated
+//hdr may be allocated and read by a thread freeing it, so the word is stored in one go
+void set_prev_status(header *hdr, bool status)
 {
-	hdr->status = status;
+	size_t word = hdr->size_n_status;
+	if (status) {
+		word |= PREV_ALLOC_BIT;
+	} else {
+		word &= ~(size_t)PREV_ALLOC_BIT;
+	}
+	__atomic_store_n(&hdr->size_n_status, word, __ATOMIC_RELAXED);
 }
 
-//function from naive which will return the status of a chunk given the header(useful for checks)
-bool get_chunk_status(header *hdr)
+//returns the arena of a chunk whose header word is word
+arena *word_arena(size_t word)
 {
-	return hdr->status;
+#ifdef MM_THREADS
+	return &global_arenas[word >> ARENA_SHIFT];
+#else
+	return &global_arenas[0];
+#endif
 }
-//fucntion returns the size of a chunk given header pointer
-size_t get_chunk_size(header *hdr)
+
+//returns the arena a chunk belongs to, without reading the header when there is only one
+arena *get_chunk_arena(header *hdr)
 {
-	return hdr->size;
+#ifdef MM_THREADS
+	//the arena bits never change, only the neighbours' frees race on the word
+	return word_arena(__atomic_load_n(&hdr->size_n_status, __ATOMIC_RELAXED));
+#else
+	return &global_arenas[0];
+#endif
 }
 
 //returns a pointer that points to the very top of the header of a chunk
 header *payload_to_header(void *p)
 {
-	return (header *)((char *)p - sizeof(header));
+	return (header *)((char *)p - HEADER_SIZE);
 }
 
 //return a pointer that points to the beginning of the payload of a chunk
 void *header_to_payload(header *hdr)
 {
-	return (void *)((char *)hdr + sizeof(header));
+	return (void *)((char *)hdr + HEADER_SIZE);
 }
 
 //function not from naive, useful when looking for an appropriate sized chunk to allocate
@@ -79,11 +373,10 @@ void *header_to_next_header(header *hdr, size_t size)
 	return (void *)((char *)hdr + size);
 }
 
-//Simple initialization for resetting a header chunk
-void init_header(header *hdr) {
-	hdr->next = NULL;
-	hdr->prev = NULL;
-	set_chunk_status(hdr, false);
+//Simple initialization for a header written into the middle of an extent
+//the chunk before it is always the allocated one it was split from, in the same arena
+void init_header(header *hdr, header *from) {
+	hdr->size_n_status = (from->size_n_status & ARENA_BITS) | PREV_ALLOC_BIT;
 }
 
 //returns pointer to next chunk of memory, used in check_heap
@@ -93,13 +386,153 @@ header *get_next_chunk(header *hdr)
 	return (header *)((char *)hdr + sz);
 }
 
-//function to reset pointers for either removing from the free list or the allocated list
-void remove_from_list(header *hdr) {
-	if (hdr == global_free_list) {
-		global_free_list = hdr->next;
+//returns the chunk physically before hdr using its footer, only valid when that chunk is free
+header *get_prev_chunk(header *hdr)
+{
+	footer *f = (footer *)((char *)hdr - sizeof(footer));
+	return (header *)((char *)hdr - *f);
+}
+
+//makes hdr the epilogue of arena a's extent, the chunk before it is allocated
+void set_epilogue(arena *a, header *hdr)
+{
+	hdr->size_n_status = a->id_bits | PREV_ALLOC_BIT | ALLOC_BIT;
+	a->epilogue = hdr;
+}
+
+//maps a chunk size below LARGE_CHUNK to the index of the bin holding chunks of that size
+int size_to_bin(size_t size)
+{
+	return (size - MIN_CHUNK) / ALIGNMENT;
+}
+
+//heap priority of a tree node, a hash of its address so it needs no storage
+unsigned long tree_priority(tree_node *n)
+{
+	return ((unsigned long)n >> 4) * 0x9E3779B97F4A7C15UL;
+}
+
+//tree order: by size, equal sizes by address
+bool tree_less(tree_node *x, tree_node *y)
+{
+	size_t xs = get_chunk_size((header *)x), ys = get_chunk_size((header *)y);
+	return xs < ys || (xs == ys && x < y);
+}
+
+//inserts n below t, rotating it up while its priority beats its parent's; returns the new root
+tree_node *tree_insert(tree_node *t, tree_node *n)
+{
+	if (t == NULL) {
+		n->left = NULL;
+		n->right = NULL;
+		return n;
+	}
+	if (tree_less(n, t)) {
+		t->left = tree_insert(t->left, n);
+		if (tree_priority(t->left) > tree_priority(t)) {
+			tree_node *l = t->left;
+			t->left = l->right;
+			l->right = t;
+			return l;
+		}
+	} else {
+		t->right = tree_insert(t->right, n);
+		if (tree_priority(t->right) > tree_priority(t)) {
+			tree_node *r = t->right;
+			t->right = r->left;
+			r->left = t;
+			return r;
+		}
+	}
+	return t;
+}
+
+//joins two trees where every node of l orders before every node of r
+tree_node *tree_merge(tree_node *l, tree_node *r)
+{
+	if (l == NULL) return r;
+	if (r == NULL) return l;
+	if (tree_priority(l) > tree_priority(r)) {
+		l->right = tree_merge(l->right, r);
+		return l;
+	}
+	r->left = tree_merge(l, r->left);
+	return r;
+}
+
+//unlinks n from the tree rooted at *link by replacing it with the merge of its children
+void tree_remove(tree_node **link, tree_node *n)
+{
+	while (*link != n) {
+		link = tree_less(n, *link) ? &(*link)->left : &(*link)->right;
+	}
+	*link = tree_merge(n->left, n->right);
+}
+
+//returns the smallest node of at least size bytes, the lowest addressed one among equals
+//and adds the number of nodes it looked at to steps
+tree_node *tree_best_fit(tree_node *t, size_t size, size_t *steps)
+{
+	tree_node *best = NULL;
+	while (t != NULL) {
+		(*steps)++;
+		if (get_chunk_size((header *)t) >= size) {
+			best = t;
+			t = t->left;
+		} else {
+			t = t->right;
+		}
+	}
+	return best;
+}
+
+//like tree_best_fit, but stops at the first node that is at most GOOD_FIT_GUARD bytes larger
+//than size
+tree_node *tree_good_fit(tree_node *t, size_t size, size_t *steps)
+{
+	tree_node *best = NULL;
+	while (t != NULL) {
+		(*steps)++;
+		if (get_chunk_size((header *)t) >= size) {
+			best = t;
+			if (get_chunk_size((header *)t) - size <= GOOD_FIT_GUARD) break;
+			t = t->left;
+		} else {
+			t = t->right;
+		}
+	}
+	return best;
+}
+
+//lowers *best to the lowest addressed node of t of at least size bytes that lies after after,
+//every node of the tree that fits is looked at and counted in steps
+void tree_lowest_fit(tree_node *t, size_t size, void *after, tree_node **best, size_t *steps)
+{
+	for (; t != NULL; t = t->right) {
+		(*steps)++;
+		if (get_chunk_size((header *)t) < size) continue;
+		if ((void *)t > after && (*best == NULL || t < *best)) *best = t;
+		tree_lowest_fit(t->left, size, after, best, steps);
+	}
+}
+
+//unlinks a free chunk from its bin, clearing the bin's bit when it empties,
+//or from the tree when it is large
+void remove_from_bin(arena *a, header *hdr) {
+	size_t size = get_chunk_size(hdr);
+#if MM_POLICY == LIFO_FIT
+	if (hdr == a->last_freed) a->last_freed = NULL;
+#endif
+	if (size >= LARGE_CHUNK) {
+		tree_remove(&a->large_tree, (tree_node *)hdr);
+		a->counters.bin_chunks[NUM_BINS]--;
+		return;
 	}
-	if (hdr == global_allocated_list_head) {
-		global_allocated_list_head = hdr->next;
+	int bin = size_to_bin(size);
+	a->counters.bin_chunks[bin]--;
+	if (hdr == a->free_bins[bin]) {
+		a->free_bins[bin] = hdr->next;
+		if (a->free_bins[bin] == NULL) a->bin_map &= ~(1UL << bin);
 	}
 	if (hdr->prev) {
 		hdr->prev->next = hdr->next;
@@ -108,255 +541,1673 @@ void remove_from_list(header *hdr) {
 		hdr->next->prev = hdr->prev;
 	}
 }
-int get_newsize(size_t size) {
-	return align(size)+sizeof(header);
+
+//chunk size needed to hold a payload of size bytes
+size_t get_newsize(size_t size) {
+	size_t newsize = align(size + HEADER_SIZE);
+	return newsize < MIN_CHUNK ? MIN_CHUNK : newsize;
 }
 
-//function attempts to merge nxt into header
-//In insert_free_list, it is shown that the free list is actually ordered in terms of address
-//This that every time something is being freed, merge_regions can be called to look at both 
-//the next and previous pointer to see if regions can be coalesced. Doing this every single time
-//free is called ensures that the chunks in the free list remain as large as possible. In certain 
-//test seeds, it can be claimed that there is too much merging going on because of the need to split
-//for a small number of bytes or go straight to s_brk.
-bool merge_regions(header *hdr, header *nxt) { 
-	if (hdr == NULL || nxt == NULL) return false;
-	if ((char *)hdr + get_chunk_size(hdr) == (char *)nxt) {
-		hdr->next = nxt->next;
-		if (nxt->next) nxt->next->prev = hdr;
-		set_chunk_size_status(hdr, get_chunk_size(hdr) + get_chunk_size(nxt), false);
-		return true;
-	}
-	return false;
+//bytes of a chunk usable by the caller
+size_t get_payload_size(header *hdr) {
+	return get_chunk_size(hdr) - HEADER_SIZE;
 }
 
-//function to insert into the allocated list
-void insert_allocated_list(header *hdr) {
-	set_chunk_status(hdr, true);
-	hdr->next = global_allocated_list_head;
-	if (global_allocated_list_head) global_allocated_list_head->prev = hdr;
+//pushes a free chunk onto the front of the bin for its size, or into the tree when it is large
+void insert_bin(arena *a, header *hdr) {
+	size_t size = get_chunk_size(hdr);
+	if (size >= LARGE_CHUNK) {
+		a->large_tree = tree_insert(a->large_tree, (tree_node *)hdr);
+		a->counters.bin_chunks[NUM_BINS]++;
+		return;
+	}
+	int bin = size_to_bin(size);
+	a->counters.bin_chunks[bin]++;
 	hdr->prev = NULL;
-	global_allocated_list_head = hdr;
-	my_assert(get_chunk_status(hdr) == true);
+	hdr->next = a->free_bins[bin];
+	if (a->free_bins[bin]) a->free_bins[bin]->prev = hdr;
+	a->free_bins[bin] = hdr;
+	a->bin_map |= 1UL << bin;
+}
+
+//hands the pages of the part [from, from + len) of the free run hdr back to the system,
+//sparing the tree node at the start of the run and its footer
+void release_run(header *hdr, size_t size, header *from, size_t len) {
+	char *lo = (char *)from;
+	char *hi = lo + len;
+	if (lo < (char *)hdr + sizeof(tree_node)) lo = (char *)hdr + sizeof(tree_node);
+	if (hi > (char *)header_to_footer(hdr, size)) hi = (char *)header_to_footer(hdr, size);
+	if (hi > lo) mem_release(lo, hi - lo);
 }
+
 //function to insert into the free list
-//traverses the list to order nodes in ascending address order
-//makes coalescing easier
-void insert_free_list(header *hdr) {
-	header* temp = global_free_list;
-	set_chunk_status(hdr, false);
-
-	if (temp == NULL) {
-		global_free_list = hdr;
-		hdr->prev = NULL;
-		hdr->next = NULL;
-		return;
+//the chunks physically before and after hdr are found through the boundary tags and
+//absorbed if they are free, so that the chunks in the bins remain as large as possible
+//no matter where in the bins the neighbours sit
+//A run that reaches RELEASE_RUN bytes has its pages released, once it is that large only
+//the part that was just freed into it is released again.
+void insert_free_list(arena *a, header *hdr) {
+	header *freed = hdr;
+	size_t freed_size = get_chunk_size(hdr);
+	size_t size = freed_size;
+	//whether a neighbour was a run large enough to have been released already
+	bool released = false;
+	header *nxt = get_next_chunk(hdr);
+	if (get_chunk_status(nxt) == false) {
+		remove_from_bin(a, nxt);
+		released |= get_chunk_size(nxt) >= RELEASE_RUN;
+		size += get_chunk_size(nxt);
+		a->counters.coalesces++;
 	}
-	if (hdr < temp) {
-		hdr->next = temp;
-		hdr->prev = NULL;
-		temp->prev = hdr;
-		global_free_list = hdr;
-	}
-	else {
-		header* last = NULL;
-		while (temp) {
-			if (hdr < temp) {
-				hdr->next = temp;
-				temp->prev->next = hdr;
-				hdr-> prev = temp->prev;
-				temp->prev = hdr;
-				break;
-			}
-			last = temp;
-			temp = temp->next;
-		}
-		if (last != NULL && temp == NULL) {
-			last->next = hdr;
-			hdr->prev = last;
-			hdr->next = NULL;
-		}
+	if (get_prev_status(hdr) == false) {
+		header *prv = get_prev_chunk(hdr);
+		remove_from_bin(a, prv);
+		released |= get_chunk_size(prv) >= RELEASE_RUN;
+		size += get_chunk_size(prv);
+		hdr = prv;
+		a->counters.coalesces++;
 	}
-	if (merge_regions(hdr, hdr->next)) {
-		merge_regions(hdr, hdr->next);
+	set_chunk_size_status(hdr, size, false);
+	set_prev_status(get_next_chunk(hdr), false);
+	insert_bin(a, hdr);
+#if MM_POLICY == LIFO_FIT
+	a->last_freed = hdr;
+#endif
+	my_assert(get_chunk_status(hdr) == false);
+	if (size >= RELEASE_RUN) {
+		release_run(hdr, size, released ? freed : hdr, released ? freed_size : size);
 	}
-	if (merge_regions(hdr->prev, hdr)) {
-		merge_regions(hdr->prev, hdr);
+}
+
+#ifdef MM_THREADS
+void init_arena_locks(void) {
+	for (int i = 0; i < NUM_ARENAS; i++) {
+		pthread_mutex_init(&global_arenas[i].lock, NULL);
 	}
-	my_assert(get_chunk_status(hdr) == false);
 }
+#endif
 
-//Initializes the free list and allocated list
+//Initializes the free bins of every arena, they get their first extent when they first allocate
 //returns 0 like the naive implementation
 int mm_init(void)
 {
-	global_free_list = NULL;
-	global_allocated_list_head= NULL;
+	for (int i = 0; i < NUM_ARENAS; i++) {
+		arena *a = &global_arenas[i];
+		for (int j = 0; j < NUM_BINS; j++) {
+			a->free_bins[j] = NULL;
+		}
+		a->bin_map = 0;
+		a->large_tree = NULL;
+		for (int j = 0; j < SLAB_CLASSES; j++) {
+			a->partial_slabs[j] = NULL;
+		}
+		a->empty_slabs = NULL;
+		a->epilogue = NULL;
+		a->id_bits = (size_t)i << ARENA_SHIFT;
+		memset(&a->counters, 0, sizeof(a->counters));
+#if MM_POLICY == NEXT_FIT
+		a->rover = NULL;
+#elif MM_POLICY == LIFO_FIT
+		a->last_freed = NULL;
+#endif
+#ifdef MM_THREADS
+		a->remote_frees = NULL;
+#endif
+	}
+	memset(global_slab_pages, 0, global_slab_words * sizeof(global_slab_pages[0]));
+	global_slab_words = 0;
+	memset(&global_counters, 0, sizeof(global_counters));
+#ifdef MM_THREADS
+	pthread_once(&arena_locks_once, init_arena_locks);
+	//every thread cache now points into the old heap
+	global_next_arena = 0;
+	__atomic_add_fetch(&global_heap_epoch, 1, __ATOMIC_RELEASE);
+#endif
 	return 0;
 }
 
-//Used in malloc, this attempts to find an already existing chunk in the free list
-//to accomodate the given size.
-void *find_memory(size_t size) {
-	if (size == 0) return NULL;
-	int newsize = get_newsize(size);
-
-    for (int i = 0; i < 2; i++) {
-		header *temp = global_free_list;
-
-		while (temp) {
-			// printf("Checking temp %lu status %d newsize %d ", get_chunk_size(temp), get_chunk_status(temp), newsize);
-
-			my_assert(get_chunk_status(temp) == false);
-
-			if (get_chunk_status(temp) == false) {
-				size_t chunk_size = get_chunk_size(temp);
-				if (i == 0) {
-					if (chunk_size >= newsize && chunk_size < newsize + MIN_GUARD) {
-						remove_from_list(temp);
-						insert_allocated_list(temp);
-						
-						return header_to_payload(temp);
-					}
-				} else {
-					if (chunk_size > newsize + sizeof(header)) {
-						size_t orig_size = chunk_size;
-						my_assert(is_aligned((void *)temp));
-						set_chunk_size_status(temp, newsize, true);
-						my_assert(get_chunk_status(temp) == true);
-						my_assert(get_chunk_size(temp) == newsize);
-						// Update global allocated list
-						remove_from_list(temp);
-						insert_allocated_list(temp);
-
-						//Need to look at the newsize here.
-						header *next_header = header_to_next_header(temp, newsize);
-						init_header(next_header);
-						my_assert(orig_size - newsize > 0);
-						set_chunk_size_status(next_header, orig_size-newsize, false);
-						// Update global free list
-						insert_free_list(next_header);
-						return header_to_payload(temp);
-					}
-				}
+//hands out temp for a request of newsize bytes, splitting off the tail
+//back into the bins when it is large enough to be a chunk of its own
+//A zeroed chunk passes its ZERO_BIT on to the tail, whose header and links only overwrite what
+//were temp's links, and leaves it on temp for allocate_chunk to take off.
+header *place_chunk(arena *a, header *temp, size_t newsize) {
+	size_t chunk_size = get_chunk_size(temp);
+	size_t zero = temp->size_n_status & ZERO_BIT;
+	remove_from_bin(a, temp);
+	if (chunk_size >= newsize + MIN_CHUNK) {
+		set_chunk_size_status(temp, newsize, true);
+		my_assert(get_chunk_size(temp) == newsize);
+
+		header *next_header = header_to_next_header(temp, newsize);
+		init_header(next_header, temp);
+		set_chunk_size_status(next_header, chunk_size - newsize, false);
+		insert_bin(a, next_header);
+		next_header->size_n_status |= zero;
+		a->counters.splits++;
+	} else {
+		set_chunk_size_status(temp, chunk_size, true);
+		set_prev_status(get_next_chunk(temp), true);
+		if (zero) *header_to_footer(temp, chunk_size) = 0;
+	}
+	temp->size_n_status |= zero;
+	return temp;
+}
+
+//gives the tail of the allocated chunk hdr beyond newsize back to the free bins
+//when it is large enough to be a chunk of its own, merging it with a free successor
+void trim_chunk(arena *a, header *hdr, size_t newsize) {
+	size_t chunk_size = get_chunk_size(hdr);
+	if (chunk_size < newsize + MIN_CHUNK) return;
+	set_chunk_size_status(hdr, newsize, true);
+
+	header *tail = header_to_next_header(hdr, newsize);
+	init_header(tail, hdr);
+	set_chunk_size_status(tail, chunk_size - newsize, true);
+	a->counters.splits++;
+	insert_free_list(a, tail);
+}
+
+//returns how many bytes at the start of the payload of h lie below zero, from where on the
+//heap is known to read as zero
+size_t dirty_below(header *h, char *zero) {
+	char *p = header_to_payload(h);
+	if (zero <= p) return 0;
+	size_t dirty = zero - p;
+	return dirty < get_payload_size(h) ? dirty : get_payload_size(h);
+}
+
+//grows hdr, the last chunk before the epilogue of arena a, to newsize bytes by moving the
+//break; only possible while the arena's extent still ends at the break
+//hdr must not be in the bins, the epilogue is rewritten at the new break
+//Unless dirty is NULL it is set to the bytes at the start of the payload that may not be zero.
+//Those of a zeroed free chunk grown by zeroed memory are only its links once its old footer
+//and the epilogue are cleared.
+bool grow_top_chunk(arena *a, header *hdr, size_t newsize, size_t *dirty) {
+	if (get_next_chunk(hdr) != a->epilogue) return false;
+	//mem_sbrk takes a signed increment
+	if (newsize - get_chunk_size(hdr) > (size_t)INTPTR_MAX) return false;
+
+	LOCK_BRK();
+	bool at_brk = (char *)mem_heap_hi() + 1 == (char *)a->epilogue + HEADER_SIZE;
+	char *zero = mem_zero_lo();
+	if (!at_brk || mem_sbrk(newsize - get_chunk_size(hdr)) == (void *)-1) {
+		UNLOCK_BRK();
+		return false;
+	}
+	UNLOCK_BRK();
+	my_assert(is_aligned(header_to_payload(hdr)));
+	char *old_brk = (char *)a->epilogue + HEADER_SIZE;
+	bool zeroed = (hdr->size_n_status & ZERO_BIT) && zero <= old_brk;
+	set_chunk_size_status(hdr, newsize, true);
+	if (dirty != NULL && zeroed) {
+		memset(old_brk - HEADER_SIZE - sizeof(footer), 0, HEADER_SIZE + sizeof(footer));
+		*dirty = LINKS_SIZE;
+	} else if (dirty != NULL) {
+		*dirty = dirty_below(hdr, zero > old_brk ? zero : old_brk);
+	}
+	set_epilogue(a, get_next_chunk(hdr));
+	return true;
+}
+
+//starts a new extent for arena a holding an allocated chunk of newsize bytes, the rest of
+//the extent goes to the bins; the previous extent keeps its epilogue as a fence
+//dirty is set like grow_top_chunk does, the rest of the extent is binned as a zeroed chunk
+//when memlib handed it out zeroed
+header *new_extent(arena *a, size_t newsize, size_t *dirty) {
+	size_t chunk_size = newsize;
+	if (a->epilogue != NULL && chunk_size < MIN_EXTENT) chunk_size = MIN_EXTENT;
+	if (chunk_size > (size_t)INTPTR_MAX - 2 * HEADER_SIZE) return NULL;
+
+	LOCK_BRK();
+	char *zero = mem_zero_lo();
+	char *start = mem_sbrk(chunk_size + 2 * HEADER_SIZE);
+	UNLOCK_BRK();
+	if (start == (void *)-1)
+		return NULL;
+
+	header *h = (header *)(start + HEADER_SIZE);
+	h->size_n_status = a->id_bits | PREV_ALLOC_BIT;
+	set_chunk_size_status(h, chunk_size, true);
+	set_epilogue(a, get_next_chunk(h));
+	trim_chunk(a, h, newsize);
+	header *tail = get_next_chunk(h);
+	if (tail != a->epilogue && (char *)tail + sizeof(header) >= zero) {
+		tail->size_n_status |= ZERO_BIT;
+	}
+	if (dirty != NULL) *dirty = dirty_below(h, zero);
+	return h;
+}
 
+#if MM_POLICY == FIRST_FIT || MM_POLICY == NEXT_FIT
+//returns the lowest addressed free chunk of arena a of at least newsize bytes that lies after
+//after, NULL if there is none; every chunk of the bins and the tree that fits is looked at
+header *lowest_fit(arena *a, size_t newsize, void *after) {
+	tree_node *best = NULL;
+	if (newsize < LARGE_CHUNK) {
+		for (unsigned long map = a->bin_map & (~0UL << size_to_bin(newsize)); map != 0; map &= map - 1) {
+			for (header *h = a->free_bins[__builtin_ctzl(map)]; h != NULL; h = h->next) {
+				a->counters.search_steps++;
+				if ((void *)h > after && (best == NULL || (tree_node *)h < best)) best = (tree_node *)h;
 			}
-			temp = temp->next;
 		}
 	}
-	return NULL;
+	tree_lowest_fit(a->large_tree, newsize, after, &best, &a->counters.search_steps);
+	return (header *)best;
+}
+#endif
+
+//Used in malloc, this attempts to find an already existing chunk in the bins
+//to accomodate a chunk of newsize bytes, picked by the placement policy MM_POLICY.
+//Bins hold a single size each, so the first non-empty bin at or above the request's,
+//found through the bin map, has the smallest small chunk that fits. Large requests,
+//and small ones no bin can serve, take the best fit from the tree. The chunks looked
+//at are counted in the arena's search_steps, one for a bin.
+header *find_memory(arena *a, size_t newsize) {
+#if MM_POLICY == FIRST_FIT
+	header *h = lowest_fit(a, newsize, NULL);
+	return h == NULL ? NULL : place_chunk(a, h, newsize);
+#elif MM_POLICY == NEXT_FIT
+	header *h = lowest_fit(a, newsize, a->rover);
+	if (h == NULL && a->rover != NULL) h = lowest_fit(a, newsize, NULL);
+	if (h == NULL) return NULL;
+	a->rover = h;
+	return place_chunk(a, h, newsize);
+#else
+#if MM_POLICY == LIFO_FIT
+	if (a->last_freed != NULL && get_chunk_size(a->last_freed) >= newsize) {
+		a->counters.search_steps++;
+		return place_chunk(a, a->last_freed, newsize);
+	}
+#endif
+	if (newsize < LARGE_CHUNK) {
+		unsigned long fits = a->bin_map & (~0UL << size_to_bin(newsize));
+		if (fits != 0) {
+			a->counters.search_steps++;
+			return place_chunk(a, a->free_bins[__builtin_ctzl(fits)], newsize);
+		}
+	}
+#if MM_POLICY == GOOD_FIT
+	tree_node *best = tree_good_fit(a->large_tree, newsize, &a->counters.search_steps);
+#else
+	tree_node *best = tree_best_fit(a->large_tree, newsize, &a->counters.search_steps);
+#endif
+	if (best == NULL) return NULL;
+	return place_chunk(a, (header *)best, newsize);
+#endif
+}
+
+void release_empty_slabs(arena *a);
+
+//takes the ZERO_BIT place_chunk left on the allocated chunk h off again, returns how many
+//bytes at the start of its payload may not be zero
+size_t take_zero_bit(header *h) {
+	if ((h->size_n_status & ZERO_BIT) == 0) return get_payload_size(h);
+	h->size_n_status &= ~(size_t)ZERO_BIT;
+	return LINKS_SIZE;
+}
+
+//returns an allocated chunk of at least newsize bytes, NULL when the heap is exhausted
+//First, memory is searched for in the free bins, then once more after the arena's empty
+//slabs have been given back to them. If that is not found, then mem_sbrk
+//is called to get more memory. When the extent still ends at the break the new chunk
+//starts where the epilogue was, and if the chunk at the top of the extent is free only
+//the missing part is requested. Otherwise a new extent is started.
+//Unless dirty is NULL it is set to how many bytes at the start of the payload may not be zero,
+//which is what calloc has to clear.
+header *allocate_chunk(arena *a, size_t newsize, size_t *dirty) {
+	size_t unused;
+	if (dirty == NULL) dirty = &unused;
+	header *h = find_memory(a, newsize);
+	if (h != NULL) {
+		*dirty = take_zero_bit(h);
+		return h;
+	}
+	if (a->empty_slabs != NULL) {
+		release_empty_slabs(a);
+		h = find_memory(a, newsize);
+		if (h != NULL) {
+			*dirty = take_zero_bit(h);
+			return h;
+		}
+	}
+	if (a->epilogue == NULL) {
+		return new_extent(a, newsize, dirty);
+	}
+
+	h = a->epilogue;
+	if (get_prev_status(h) == false) {
+		h = get_prev_chunk(h);
+		remove_from_bin(a, h);
+		if (grow_top_chunk(a, h, newsize, dirty)) {
+			return h;
+		}
+		insert_bin(a, h);
+	} else if (grow_top_chunk(a, h, newsize, dirty)) {
+		//the epilogue itself became the new chunk
+		return h;
+	}
+	return new_extent(a, newsize, dirty);
+}
+
+//returns an allocated chunk of at least newsize bytes whose payload is aligned to alignment,
+//a power of two larger than ALIGNMENT. A chunk with room for any offset is allocated and the
+//space in front of the aligned payload, which is at least a minimal chunk, goes back to the bins.
+header *allocate_aligned_chunk(arena *a, size_t newsize, size_t alignment) {
+	header *h = allocate_chunk(a, newsize + alignment + MIN_CHUNK, NULL);
+	if (h == NULL) return NULL;
+
+	uintptr_t p = (uintptr_t)header_to_payload(h);
+	uintptr_t q = (p + alignment - 1) & ~(uintptr_t)(alignment - 1);
+	if (q != p && q - p < MIN_CHUNK) q += alignment;
+	if (q != p) {
+		size_t chunk_size = get_chunk_size(h);
+		size_t lead = q - p;
+		header *aligned = payload_to_header((void *)q);
+		set_chunk_size_status(h, lead, true);
+		init_header(aligned, h);
+		set_chunk_size_status(aligned, chunk_size - lead, true);
+		a->counters.splits++;
+		insert_free_list(a, h);
+		h = aligned;
+	}
+	trim_chunk(a, h, newsize);
+	return h;
+}
+
+//returns the slab class for objects of size bytes
+int slab_class(size_t size) {
+	return (size - 1) / ALIGNMENT;
+}
+
+//index of the page holding p in global_slab_pages, or -1 when p lies outside the heap
+long slab_page_index(void *p) {
+	uintptr_t page = (uintptr_t)p & ~(uintptr_t)(SLAB_SIZE - 1);
+	uintptr_t lo = (uintptr_t)mem_heap_lo();
+	if (page < lo || page - lo >= HEAP_LIMIT) return -1;
+	return (page - lo) / SLAB_SIZE;
+}
+
+//marks the page of s as being a slab or not, other bits of the word may change concurrently
+void set_slab_page(slab *s, bool is_slab) {
+	long i = slab_page_index(s);
+	unsigned long bit = 1UL << (i % 64);
+	if (is_slab) {
+		unsigned long words = __atomic_load_n(&global_slab_words, __ATOMIC_RELAXED);
+		while (words <= (unsigned long)i / 64 &&
+		       !__atomic_compare_exchange_n(&global_slab_words, &words, i / 64 + 1, true,
+						    __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+		__atomic_fetch_or(&global_slab_pages[i / 64], bit, __ATOMIC_RELAXED);
+	} else {
+		__atomic_fetch_and(&global_slab_pages[i / 64], ~bit, __ATOMIC_RELAXED);
+	}
+}
+
+//returns the slab p was carved out of, NULL when p is the payload of a chunk
+slab *get_slab(void *p) {
+	long i = slab_page_index(p);
+	if (i < 0) return NULL;
+	unsigned long word = __atomic_load_n(&global_slab_pages[i / 64], __ATOMIC_RELAXED);
+	if ((word & (1UL << (i % 64))) == 0) return NULL;
+	return (slab *)((uintptr_t)p & ~(uintptr_t)(SLAB_SIZE - 1));
+}
+
+//links s at the front of the slab list at head
+void push_slab(slab **head, slab *s) {
+	s->prev = NULL;
+	s->next = *head;
+	if (*head) (*head)->prev = s;
+	*head = s;
+}
+
+//unlinks s from the slab list at head
+void remove_slab(slab **head, slab *s) {
+	if (*head == s) *head = s->next;
+	if (s->prev) s->prev->next = s->next;
+	if (s->next) s->next->prev = s->prev;
 }
 
+//hands the chunk of s, a slab of arena a without allocated objects, back to the bins
+//s is either on the arena's empty slabs or the last slab of its class with free objects
+void release_empty_slab(arena *a, slab *s) {
+	if (s->object_size == 0) {
+		remove_slab(&a->empty_slabs, s);
+	} else {
+		remove_slab(&a->partial_slabs[slab_class(s->object_size)], s);
+	}
+	set_slab_page(s, false);
+	insert_free_list(a, payload_to_header(s));
+}
+
+//hands the chunks of all of arena a's empty slabs back to the bins
+void release_empty_slabs(arena *a) {
+	while (a->empty_slabs != NULL) {
+		release_empty_slab(a, a->empty_slabs);
+	}
+}
+
+//returns the slab whose chunk ends right before hdr when none of its objects are allocated,
+//NULL otherwise
+slab *empty_slab_before(header *hdr) {
+	void *p = (char *)hdr - SLAB_SIZE + HEADER_SIZE;
+	if (((uintptr_t)p & (SLAB_SIZE - 1)) != 0) return NULL;
+	slab *s = get_slab(p);
+	return s != NULL && s->free_count == s->num_objects ? s : NULL;
+}
+
+//sets up a slab for objects of class idx in arena a, reusing an empty slab if there is one
+//and carving a page aligned chunk otherwise
+slab *new_slab(arena *a, int idx) {
+	slab *s = a->empty_slabs;
+	if (s != NULL) {
+		remove_slab(&a->empty_slabs, s);
+	} else {
+		//a slab chunk is exactly SLAB_SIZE long, so slabs carved one after the other
+		//from the top of the heap follow each other without gaps
+		header *h = allocate_aligned_chunk(a, SLAB_SIZE, SLAB_SIZE);
+		if (h == NULL) return NULL;
+		s = header_to_payload(h);
+		if (slab_page_index(s) < 0) {
+			//past the pages global_slab_pages covers, which no heap reaches,
+			//small requests get chunks there
+			insert_free_list(a, h);
+			return NULL;
+		}
+		set_slab_page(s, true);
+	}
+
+	s->object_size = (size_t)(idx + 1) * ALIGNMENT;
+	s->owner = a;
+	s->num_objects = (SLAB_SIZE - HEADER_SIZE - SLAB_HEADER_SIZE) / s->object_size;
+	s->free_count = s->num_objects;
+	memset(s->free_map, 0, sizeof(s->free_map));
+	for (int i = 0; i < s->num_objects; i++) {
+		s->free_map[i / 64] |= 1UL << (i % 64);
+	}
+	push_slab(&a->partial_slabs[idx], s);
+	return s;
+}
+
+//returns a free object of slab class idx from arena a, starting a slab when none has one
+//returns NULL when no slab can be started, the caller then falls back to a chunk
+void *slab_alloc(arena *a, int idx) {
+	slab *s = a->partial_slabs[idx];
+	if (s == NULL && (s = new_slab(a, idx)) == NULL) return NULL;
+
+	int w = 0;
+	while (s->free_map[w] == 0) w++;
+	int i = w * 64 + __builtin_ctzl(s->free_map[w]);
+	s->free_map[w] &= ~(1UL << (i % 64));
+	if (--s->free_count == 0) remove_slab(&a->partial_slabs[idx], s);
+	return (char *)s + SLAB_HEADER_SIZE + i * s->object_size;
+}
+
+//returns the object p to its slab s in arena a. A slab that becomes empty moves to the
+//arena's empty slabs unless it is the only one of its class with free objects, which is kept
+//so that a single object allocated and freed over and over does not move a slab every time.
+//Empty slabs have an object size of 0.
+void slab_free(arena *a, slab *s, void *p) {
+	slab **partial = &a->partial_slabs[slab_class(s->object_size)];
+	int i = ((char *)p - (char *)s - SLAB_HEADER_SIZE) / s->object_size;
+	my_assert((s->free_map[i / 64] & (1UL << (i % 64))) == 0);
+	s->free_map[i / 64] |= 1UL << (i % 64);
+	if (s->free_count++ == 0) push_slab(partial, s);
+	if (s->free_count < s->num_objects) return;
+	if (*partial == s && s->next == NULL) return;
+
+	remove_slab(partial, s);
+	s->object_size = 0;
+	push_slab(&a->empty_slabs, s);
+}
+
+//returns the lowest header of the free chunks and empty slabs that end the extent of arena a,
+//its epilogue when the last chunk is in use
+header *top_of_extent(arena *a) {
+	header *top = a->epilogue;
+	slab *s;
+	for (;;) {
+		if (get_prev_status(top) == false) {
+			top = get_prev_chunk(top);
+		} else if ((s = empty_slab_before(top)) != NULL) {
+			top = payload_to_header(s);
+		} else {
+			return top;
+		}
+	}
+}
+
+//Gives the top of arena a's extent back to the system when the free chunks and empty slabs
+//that end it add up to the trim threshold and the extent still ends at the break. The slabs
+//are released first, so that everything merges into a single free chunk. Half the threshold
+//is kept at the top so a heap that shrinks and grows by a little does not move the break
+//every time.
+void trim_top(arena *a) {
+	if (a->epilogue == NULL) return;
+	header *top = top_of_extent(a);
+	if ((size_t)((char *)a->epilogue - (char *)top) < global_trim_threshold || top == a->epilogue) return;
+
+	slab *s;
+	while ((s = empty_slab_before(a->epilogue)) != NULL ||
+	       (get_prev_status(a->epilogue) == false &&
+		(s = empty_slab_before(get_prev_chunk(a->epilogue))) != NULL)) {
+		release_empty_slab(a, s);
+	}
+	top = get_prev_chunk(a->epilogue);
+	size_t size = get_chunk_size(top);
+	size_t zero = top->size_n_status & ZERO_BIT;
+	size_t keep = (global_trim_threshold / 2) & ~(size_t)(ALIGNMENT - 1);
+	if (keep < MIN_CHUNK) keep = 0;
+	if (size <= keep) return;
+
+	LOCK_BRK();
+	bool at_brk = (char *)mem_heap_hi() + 1 == (char *)a->epilogue + HEADER_SIZE;
+	if (at_brk) {
+		remove_from_bin(a, top);
+		mem_sbrk(-(intptr_t)(size - keep));
+		set_epilogue(a, header_to_next_header(top, keep));
+		if (keep != 0) {
+			set_chunk_size_status(top, keep, false);
+			set_prev_status(a->epilogue, false);
+			insert_bin(a, top);
+			top->size_n_status |= zero;
+		}
+	}
+	UNLOCK_BRK();
+}
+
+//hands a block back to arena a, which owns it; the arena lock must be held
+void free_block(arena *a, header *h) {
+	slab *s = get_slab(header_to_payload(h));
+	if (s != NULL) {
+		slab_free(a, s, header_to_payload(h));
+	} else {
+		insert_free_list(a, h);
+	}
+}
+
+//The payload of a huge chunk starts lead bytes into its region, 2 * HEADER_SIZE unless it was
+//allocated with a larger alignment. lead is at most a page, so the region starts at the page of
+//the header and lead is found again from the header alone.
+#define HUGE_LEAD (2 * HEADER_SIZE)
+
+//bytes of the region holding a huge chunk of newsize bytes, the lead and epilogue room included
+size_t huge_region_size(size_t newsize, size_t lead) {
+	size_t page = mem_pagesize();
+	return (newsize + lead + page - 1) & ~(page - 1);
+}
+
+//writes the header of the huge chunk filling the region of len bytes at region from lead on
+header *init_huge_chunk(char *region, size_t len, size_t lead) {
+	header *h = payload_to_header(region + lead);
+	h->size_n_status = (len - lead) | HUGE_BIT | PREV_ALLOC_BIT | ALLOC_BIT;
+	return h;
+}
+
+//returns the start of the region of the huge chunk hdr
+char *huge_region(header *hdr) {
+	return (char *)((uintptr_t)hdr & ~(uintptr_t)(mem_pagesize() - 1));
+}
+
+//returns the offset of the payload of the huge chunk hdr in its region
+size_t huge_lead(header *hdr) {
+	return (char *)header_to_payload(hdr) - huge_region(hdr);
+}
+
+//returns whether hdr is the header of a chunk mapped on its own
+bool is_huge_chunk(header *hdr) {
+	//the bit never changes, only the neighbours' frees race on the word of a heap chunk
+	return __atomic_load_n(&hdr->size_n_status, __ATOMIC_RELAXED) & HUGE_BIT;
+}
+
+//returns a chunk of at least newsize bytes in a region of its own whose payload starts lead
+//bytes into the region, NULL when none can be mapped
+//memlib is shared by all arenas, so it is called under the break lock
+header *huge_alloc(size_t newsize, size_t lead) {
+	size_t len = huge_region_size(newsize, lead);
+	LOCK_BRK();
+	char *region = mem_map(len);
+	UNLOCK_BRK();
+	if (region == NULL) return NULL;
+	return init_huge_chunk(region, len, lead);
+}
+
+//unmaps the region of the huge chunk hdr
+void huge_free(header *hdr) {
+	size_t lead = huge_lead(hdr);
+	LOCK_BRK();
+	mem_unmap(huge_region(hdr), get_chunk_size(hdr) + lead);
+	UNLOCK_BRK();
+}
+
+//resizes the region of the huge chunk hdr to hold newsize bytes, returns the chunk, which moves
+//along with the region and keeps its lead, or NULL when the region could not be resized
+header *huge_realloc(header *hdr, size_t newsize) {
+	size_t lead = huge_lead(hdr);
+	size_t len = huge_region_size(newsize, lead);
+	if (len == get_chunk_size(hdr) + lead) return hdr;
+	LOCK_BRK();
+	char *region = mem_remap(huge_region(hdr), len);
+	UNLOCK_BRK();
+	if (region == NULL) return NULL;
+	return init_huge_chunk(region, len, lead);
+}
+
+#ifdef MM_THREADS
+//hands every block other threads freed into arena a back to its bins, the arena lock must be held
+void drain_remote_frees(arena *a) {
+	if (__atomic_load_n(&a->remote_frees, __ATOMIC_RELAXED) == NULL) return;
+	header *h = __atomic_exchange_n(&a->remote_frees, NULL, __ATOMIC_ACQUIRE);
+	while (h != NULL) {
+		header *nxt = h->next;
+		free_block(a, h);
+		h = nxt;
+	}
+}
+
+//pushes a block freed by a thread that does not own arena a onto its remote-free stack
+//the owner takes the whole stack at once, so pushes never race with pops of single nodes
+void push_remote_free(arena *a, header *h) {
+	header *head = __atomic_load_n(&a->remote_frees, __ATOMIC_RELAXED);
+	do {
+		h->next = head;
+	} while (!__atomic_compare_exchange_n(&a->remote_frees, &head, h, true,
+					      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
 
-/* 
+//returns the cache class for chunks of the given size, -1 if they are not cached
+int tcache_class(size_t size) {
+	size_t idx = (size - MIN_CHUNK) / ALIGNMENT;
+	return idx < TCACHE_CLASSES ? (int)idx : -1;
+}
+
+//hands the count blocks of class idx of tc that were cached first back to the bins or their
+//slabs, the home arena's lock must be held; the recently freed ones are kept as they are the
+//likeliest to be reused, and the old ones are the likeliest to let the heap be trimmed
+void tcache_flush(tcache *tc, int idx, int count) {
+	if (count > tc->counts[idx]) count = tc->counts[idx];
+	if (count == 0) return;
+	header **link = &tc->classes[idx];
+	for (int kept = tc->counts[idx] - count; kept > 0; kept--) {
+		link = &(*link)->next;
+	}
+	header *h = *link;
+	*link = NULL;
+	tc->counts[idx] -= count;
+	while (h != NULL) {
+		header *nxt = h->next;
+		free_block(tc->home, h);
+		h = nxt;
+	}
+}
+
+//adds the live bytes counted since the last time to global_counters, raising the peak
+//when they pass it
+void publish_live(size_t bytes) {
+	size_t live = __atomic_add_fetch(&global_counters.live_bytes, bytes, __ATOMIC_RELAXED);
+	size_t peak = __atomic_load_n(&global_counters.peak_bytes, __ATOMIC_RELAXED);
+	while (live > peak && !__atomic_compare_exchange_n(&global_counters.peak_bytes, &peak, live, true,
+							   __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+//adds n to a counter of the calling thread, which mm_stats may read meanwhile
+void count_add(size_t *counter, size_t n) {
+	__atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+//takes the cache of an exiting thread off global_tcaches, its counters go to global_counters
+//unless they were counted before mm_init reset them
+void tcache_unlist(tcache *tc) {
+	pthread_mutex_lock(&global_tcaches_lock);
+	tcache **link = &global_tcaches;
+	while (*link != tc) link = &(*link)->next;
+	*link = tc->next;
+	tc->listed = false;
+	if (tc->epoch == __atomic_load_n(&global_heap_epoch, __ATOMIC_ACQUIRE)) {
+		__atomic_fetch_add(&global_counters.mallocs, tc->counters.mallocs, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&global_counters.frees, tc->counters.frees, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&global_counters.reallocs, tc->counters.reallocs, __ATOMIC_RELAXED);
+		publish_live(tc->counters.live_bytes - tc->published);
+	}
+	pthread_mutex_unlock(&global_tcaches_lock);
+}
+
+//thread exit destructor, the thread's cached chunks go back to the bins
+void tcache_release(void *arg) {
+	tcache *tc = arg;
+	tcache_unlist(tc);
+	if (tc->epoch != __atomic_load_n(&global_heap_epoch, __ATOMIC_ACQUIRE)) return;
+	LOCK_ARENA(tc->home);
+	for (int i = 0; i < TCACHE_LISTS; i++) {
+		tcache_flush(tc, i, tc->counts[i]);
+	}
+	drain_remote_frees(tc->home);
+	trim_top(tc->home);
+	UNLOCK_ARENA(tc->home);
+}
+
+void tcache_make_key(void) {
+	pthread_key_create(&tcache_key, tcache_release);
+}
+
+//returns the calling thread's cache, emptied and given an arena if the heap was reset since
+//it was filled; arenas are handed out round robin so each thread owns one while there are
+//no more threads than arenas
+tcache *get_tcache(void) {
+	tcache *tc = &thread_cache;
+	unsigned long epoch = __atomic_load_n(&global_heap_epoch, __ATOMIC_ACQUIRE);
+	if (tc->epoch != epoch) {
+		pthread_once(&tcache_key_once, tcache_make_key);
+		pthread_setspecific(tcache_key, tc);
+		memset(tc->classes, 0, sizeof(tc->classes));
+		memset(tc->counts, 0, sizeof(tc->counts));
+		tc->home = &global_arenas[__atomic_fetch_add(&global_next_arena, 1, __ATOMIC_RELAXED) % NUM_ARENAS];
+		//mm_stats only reads the counters of caches of the current heap, under the lock
+		pthread_mutex_lock(&global_tcaches_lock);
+		if (!tc->listed) {
+			tc->next = global_tcaches;
+			global_tcaches = tc;
+			tc->listed = true;
+		}
+		memset(&tc->counters, 0, sizeof(tc->counters));
+		tc->published = 0;
+		tc->epoch = epoch;
+		pthread_mutex_unlock(&global_tcaches_lock);
+	}
+	return tc;
+}
+
+//takes TCACHE_BATCH chunks of newsize bytes, or slab objects for the slab classes,
+//from the home arena into class idx under one lock
+//returns false when not even one could be allocated
+bool tcache_refill(tcache *tc, int idx, size_t newsize) {
+	LOCK_ARENA(tc->home);
+	drain_remote_frees(tc->home);
+	for (int i = 0; i < TCACHE_BATCH; i++) {
+		header *h;
+		if (idx >= TCACHE_CLASSES) {
+			void *p = slab_alloc(tc->home, idx - TCACHE_CLASSES);
+			h = p == NULL ? NULL : payload_to_header(p);
+		} else {
+			h = allocate_chunk(tc->home, newsize, NULL);
+		}
+		if (h == NULL) break;
+		h->next = tc->classes[idx];
+		tc->classes[idx] = h;
+		tc->counts[idx]++;
+	}
+	UNLOCK_ARENA(tc->home);
+	return tc->classes[idx] != NULL;
+}
+#endif
+
+//returns the arena the calling thread allocates from
+arena *get_thread_arena(void) {
+#ifdef MM_THREADS
+	return get_tcache()->home;
+#else
+	return &global_arenas[0];
+#endif
+}
+
+//adds bytes, which wrap around to take some off, to the live bytes, raising the peak when they
+//pass it. The thread-safe build counts them in the thread's cache and only publishes them every
+//LIVE_STEP bytes, so the peak may miss up to that much per thread.
+void count_live(size_t bytes) {
+#ifdef MM_THREADS
+	tcache *tc = get_tcache();
+	size_t live = tc->counters.live_bytes + bytes;
+	__atomic_store_n(&tc->counters.live_bytes, live, __ATOMIC_RELAXED);
+	ptrdiff_t pending = live - tc->published;
+	if (pending > LIVE_STEP || pending < -LIVE_STEP) {
+		__atomic_store_n(&tc->published, live, __ATOMIC_RELAXED);
+		publish_live(pending);
+	}
+#else
+	global_counters.live_bytes += bytes;
+	if (global_counters.live_bytes > global_counters.peak_bytes)
+		global_counters.peak_bytes = global_counters.live_bytes;
+#endif
+}
+
+//counts a call that allocates a block, p is the block or NULL when there is none
+void *count_malloc(void *p) {
+	COUNT(mallocs, 1);
+	if (p != NULL) count_live(mm_usable_size(p));
+	return p;
+}
+
+//counts the free of a block of usable bytes
+void count_free(size_t usable) {
+	COUNT(frees, 1);
+	count_live(-usable);
+}
+
+/*
  * mm_malloc allocates a memory block of size bytes
- * First, memory is searched for in the free list. 
- * If that is not found, then mem_sbrk is called to get more memory.
+ * Small blocks come from the thread's cache in the thread-safe build, huge ones are mapped
+ * on their own and everything else is served from the thread's arena under the arena lock,
+ * by slab_alloc for requests of up to SLAB_MAX_OBJECT bytes and by allocate_chunk for the rest.
  */
 void *mm_malloc(size_t size)
 {
-	if (size == 0) return NULL;
-
-	void *allocated_memory = find_memory(size);
-	if (allocated_memory != NULL) {
-		return allocated_memory;
-	}
+	//larger sizes would overflow the chunk size
+	if (size == 0 || size > PTRDIFF_MAX) return count_malloc(NULL);
 
 	// printf("Allocating: %ld", size);
-	int newsize = align(size) + sizeof(header);
-
-	header *h = (header *)mem_sbrk(newsize);
-	// if (h == (void *)-1)
-	// 	return NULL;
-	//else {
-		my_assert(is_aligned((void *)h));
-		set_chunk_size_status(h, newsize, true);
-		my_assert(get_chunk_status(h) == true);
-		my_assert(get_chunk_size(h) == newsize);
-		// Update global allocated list
-		insert_allocated_list(h);
-		return header_to_payload(h);
-	//}
-	
-	return NULL;
+	size_t newsize = get_newsize(size);
+	if (newsize >= HUGE_CHUNK) {
+		header *h = huge_alloc(newsize, HUGE_LEAD);
+		return count_malloc(h == NULL ? NULL : header_to_payload(h));
+	}
+#ifdef MM_THREADS
+	tcache *tc = get_tcache();
+	int idx = size <= SLAB_MAX_OBJECT ? TCACHE_CLASSES + slab_class(size) : tcache_class(newsize);
+	if (idx >= 0 && (tc->classes[idx] != NULL || tcache_refill(tc, idx, newsize))) {
+		header *h = tc->classes[idx];
+		tc->classes[idx] = h->next;
+		tc->counts[idx]--;
+		return count_malloc(header_to_payload(h));
+	}
+#endif
+	arena *a = get_thread_arena();
+	if (size <= SLAB_MAX_OBJECT) {
+		LOCK_ARENA(a);
+		void *p = slab_alloc(a, slab_class(size));
+		UNLOCK_ARENA(a);
+		if (p != NULL)
+			return count_malloc(p);
+	}
+	LOCK_ARENA(a);
+#ifdef MM_THREADS
+	drain_remote_frees(a);
+#endif
+	header *h = allocate_chunk(a, newsize, NULL);
+	UNLOCK_ARENA(a);
+	return count_malloc(h == NULL ? NULL : header_to_payload(h));
 }
 
 
 
+//hands the block ptr back to its arena a, s is its slab or NULL, size is the size of its chunk
+//or less, which is all the thread cache needs to pick a class
+void free_to_arena(arena *a, slab *s, void *ptr, size_t size)
+{
+	header *h = payload_to_header(ptr);
+#ifdef MM_THREADS
+	tcache *tc = get_tcache();
+	if (a != tc->home) {
+		push_remote_free(a, h);
+		return;
+	}
+	int idx = s != NULL ? TCACHE_CLASSES + slab_class(s->object_size) : tcache_class(size);
+	if (idx >= 0) {
+		h->next = tc->classes[idx];
+		tc->classes[idx] = h;
+		if (++tc->counts[idx] > TCACHE_MAX) {
+			LOCK_ARENA(a);
+			tcache_flush(tc, idx, TCACHE_MAX / 2);
+			trim_top(a);
+			UNLOCK_ARENA(a);
+		}
+		return;
+	}
+#endif
+	LOCK_ARENA(a);
+	if (s != NULL) {
+		slab_free(a, s, ptr);
+	} else {
+		insert_free_list(a, h);
+	}
+	trim_top(a);
+	UNLOCK_ARENA(a);
+}
+
 /*
  * mm_free frees the previously allocated memory block
- * asserts ensures that the pointer is not outside of the heap.
- * function effectively removes allocated memory from allocates list to free list.
+ * asserts ensures that the pointer is not outside of the heap unless it is a huge block,
+ * whose region is unmapped right away.
+ * function effectively hands the chunk back to the free bins of its arena, or the object
+ * back to its slab. In the thread-safe build small blocks of the thread's own arena go to
+ * its cache instead, and blocks of other arenas are queued for their owners.
  */
 void mm_free(void *ptr)
 {
-	my_assert(ptr >= mem_heap_lo() && ptr <= mem_heap_hi());
 	header *h;
 	h = payload_to_header(ptr);
-	// Update global free list
-	remove_from_list(h);
-	insert_free_list(h);
-}	
+	slab *s = get_slab(ptr);
+	if (s == NULL && is_huge_chunk(h)) {
+		count_free(get_payload_size(h));
+		huge_free(h);
+		return;
+	}
+	my_assert(ptr >= mem_heap_lo() && ptr <= mem_heap_hi());
+	if (s != NULL) {
+		count_free(s->object_size);
+		free_to_arena(s->owner, s, ptr, s->object_size);
+		return;
+	}
+	//the size and arena bits of an allocated chunk never change, so one load serves both
+	size_t word = __atomic_load_n(&h->size_n_status, __ATOMIC_RELAXED);
+	count_free((word & SIZE_MASK) - HEADER_SIZE);
+	free_to_arena(word_arena(word), NULL, ptr, word & SIZE_MASK);
+}
+
+/*
+ * mm_free_sized frees ptr like mm_free, given the size it was last allocated or reallocated
+ * with, and trusts that size to route it. Slab objects are found through the page bitmap as
+ * always. Only a size that a huge block could have gets the header checked for the huge bit.
+ * Otherwise the thread cache class and what mm_stats counts come from the size, as the chunk
+ * holds at least that, so the header is not read before the chunk goes back to its arena,
+ * except for the arena bits in the thread-safe build, where several arenas may own chunks.
+ */
+void mm_free_sized(void *ptr, size_t size)
+{
+	size_t newsize = get_newsize(size);
+	header *h = payload_to_header(ptr);
+	slab *s = get_slab(ptr);
+	if (s != NULL) {
+		count_free(s->object_size);
+		free_to_arena(s->owner, s, ptr, newsize);
+		return;
+	}
+	if (newsize >= HUGE_CHUNK && is_huge_chunk(h)) {
+		count_free(get_payload_size(h));
+		huge_free(h);
+		return;
+	}
+	my_assert(newsize <= get_chunk_size(h));
+	count_free(newsize - HEADER_SIZE);
+	free_to_arena(get_chunk_arena(h), NULL, ptr, newsize);
+}
+
+/*
+ * mm_usable_size returns how many bytes the block ptr can hold, at least what it was allocated
+ * with. Growing it with mm_realloc up to this size keeps it where it is.
+ */
+size_t mm_usable_size(void *ptr)
+{
+	slab *s = get_slab(ptr);
+	if (s != NULL) return s->object_size;
+	header *h = payload_to_header(ptr);
+	return (__atomic_load_n(&h->size_n_status, __ATOMIC_RELAXED) & SIZE_MASK) - HEADER_SIZE;
+}
+
+//tries to resize the allocated chunk hdr to newsize bytes without moving its payload
+//a shrink always succeeds, a grow needs a free successor that is large enough or the
+//chunk (alone or together with a free successor) to be last in the heap so the break can move
+bool resize_in_place(arena *a, header *hdr, size_t newsize) {
+	size_t chunk_size = get_chunk_size(hdr);
+	if (newsize <= chunk_size) {
+		trim_chunk(a, hdr, newsize);
+		return true;
+	}
+
+	header *nxt = get_next_chunk(hdr);
+	if (nxt == a->epilogue) {
+		return grow_top_chunk(a, hdr, newsize, NULL);
+	}
+	if (get_chunk_status(nxt) == true) return false;
+
+	size_t merged = chunk_size + get_chunk_size(nxt);
+	bool nxt_is_top = get_next_chunk(nxt) == a->epilogue;
+	if (merged < newsize && !nxt_is_top) return false;
+
+	remove_from_bin(a, nxt);
+	set_chunk_size_status(hdr, merged, true);
+	set_prev_status(get_next_chunk(hdr), true);
+	if (merged >= newsize) {
+		trim_chunk(a, hdr, newsize);
+		return true;
+	}
+	if (grow_top_chunk(a, hdr, newsize, NULL)) return true;
+	trim_chunk(a, hdr, chunk_size);
+	return false;
+}
 
 /*
- * mm_realloc changes the size of the memory block pointed to by ptr to size bytes.  
- * The purpose of realloc is to efficiently move a payload into a larger sized chunk of memory.
- * Realloc calls malloc, copies payload over, the frees the given pointer because the new one
- * has been allocated. 
+ * mm_realloc changes the size of the memory block pointed to by ptr to size bytes.
+ * The block is resized where it is whenever possible: shrinking splits off the tail,
+ * growing absorbs a free successor or moves the break when the block is at the top
+ * of the heap. Slab objects stay where they are while the new size still fits the object,
+ * huge blocks have their region resized as long as they stay huge.
+ * Only when none of that works does realloc call malloc, copy the payload over and free
+ * the given pointer.
  */
 void *mm_realloc(void *ptr, size_t size)
 {
-	void *newptr = NULL;
-	if (size > 0) {
-		newptr = mm_malloc(size);
-		// if (newptr == NULL)
-		// 	return NULL;
+	COUNT(reallocs, 1);
+	if (ptr == NULL) {
+		return mm_malloc(size);
+	}
+	if (size == 0) {
+		mm_free(ptr);
+		return NULL;
+	}
+	if (size > PTRDIFF_MAX) return NULL;
+
+	header *h = payload_to_header(ptr);
+	slab *s = get_slab(ptr);
+	size_t newsize = get_newsize(size);
+	size_t copySize;
+	if (s != NULL) {
+		if (size <= s->object_size) {
+			return ptr;
+		}
+		copySize = s->object_size;
+	} else if (is_huge_chunk(h)) {
+		if (newsize >= HUGE_CHUNK) {
+			size_t old = get_payload_size(h);
+			header *moved = huge_realloc(h, newsize);
+			if (moved == NULL) return NULL;
+			count_live(get_payload_size(moved) - old);
+			return header_to_payload(moved);
+		}
+		//moving down into the heap
+		copySize = size;
+	} else {
+		arena *a = get_chunk_arena(h);
+		LOCK_ARENA(a);
+		//a block that grows huge stays in the heap while it can grow in place,
+		//once it has to move it moves to a region of its own
+		size_t old = get_payload_size(h);
+		bool resized = resize_in_place(a, h, newsize);
+		copySize = get_payload_size(h);
+		trim_top(a);
+		UNLOCK_ARENA(a);
+		if (resized) {
+			count_live(copySize - old);
+			return ptr;
+		}
+	}
+
+	void *newptr = mm_malloc(size);
+	if (newptr == NULL)
+		return NULL;
+	//a heap block only moves when growing, so its whole old payload is copied
+	memcpy(newptr, ptr, copySize);
+	mm_free(ptr);
+	return newptr;
+}
+
+//splits the allocated chunk h into count chunks of newsize bytes, the last one keeping whatever
+//is left over, and stores their payloads in out
+void split_run(header *h, size_t newsize, size_t count, void **out) {
+	size_t rest = get_chunk_size(h);
+	for (size_t i = 0; i + 1 < count; i++) {
+		out[i] = header_to_payload(h);
+		set_chunk_size_status(h, newsize, true);
+		header *next = header_to_next_header(h, newsize);
+		init_header(next, h);
+		rest -= newsize;
+		set_chunk_size_status(next, rest, true);
+		h = next;
+	}
+	out[count - 1] = header_to_payload(h);
+}
+
+//counts the n blocks in out allocated by a batch like n calls of mm_malloc, returns n
+size_t count_batch(void **out, size_t n) {
+	size_t bytes = 0;
+	for (size_t i = 0; i < n; i++) {
+		bytes += mm_usable_size(out[i]);
+	}
+	COUNT(mallocs, n);
+	count_live(bytes);
+	return n;
+}
+
+/*
+ * mm_malloc_batch allocates n blocks of size bytes each, stores them in out and returns how many
+ * it got, fewer than n only when memory runs out. The arena lock is taken once for the whole
+ * batch. Blocks that fit in a slab are taken from slabs, the others are carved out of runs:
+ * allocate_chunk finds a single chunk for many of them, which split_run cuts up, so a run costs
+ * one search of the free structures. Runs stay below HUGE_CHUNK, huge blocks are mapped one by one.
+ */
+size_t mm_malloc_batch(size_t size, size_t n, void **out)
+{
+	size_t got = 0;
+	if (size == 0 || size > PTRDIFF_MAX) return 0;
+	size_t newsize = get_newsize(size);
+	if (newsize >= HUGE_CHUNK) {
+		for (; got < n; got++) {
+			header *h = huge_alloc(newsize, HUGE_LEAD);
+			if (h == NULL) break;
+			out[got] = header_to_payload(h);
+		}
+		return count_batch(out, got);
+	}
+
+	arena *a = get_thread_arena();
+	LOCK_ARENA(a);
+#ifdef MM_THREADS
+	drain_remote_frees(a);
+#endif
+	if (size <= SLAB_MAX_OBJECT) {
+		for (; got < n; got++) {
+			void *p = slab_alloc(a, slab_class(size));
+			if (p == NULL) break;
+			out[got] = p;
+		}
+	}
+	//what slabs could not serve comes from runs, which get shorter when memory runs out
+	size_t per_run = HUGE_CHUNK / newsize;
+	while (got < n) {
+		size_t count = n - got < per_run ? n - got : per_run;
+		header *h = allocate_chunk(a, count * newsize, NULL);
+		if (h == NULL) {
+			if (count == 1) break;
+			per_run = count / 2;
+			continue;
+		}
+		split_run(h, newsize, count, out + got);
+		a->counters.splits += count - 1;
+		got += count;
+	}
+	UNLOCK_ARENA(a);
+	return count_batch(out, got);
+}
+
+//restores the heap order of v[0..n) below v[i], the largest address on top
+void sift_down(void **v, size_t i, size_t n) {
+	void *x = v[i];
+	for (size_t c; (c = 2 * i + 1) < n; i = c) {
+		if (c + 1 < n && (uintptr_t)v[c + 1] > (uintptr_t)v[c]) c++;
+		if ((uintptr_t)x >= (uintptr_t)v[c]) break;
+		v[i] = v[c];
+	}
+	v[i] = x;
+}
+
+//sorts v[0..n) by address in place, with a heap sort so that freeing needs no memory of its own
+void sort_pointers(void **v, size_t n) {
+	for (size_t i = n / 2; i-- > 0;) {
+		sift_down(v, i, n);
+	}
+	for (size_t end = n; end-- > 1;) {
+		void *top = v[0];
+		v[0] = v[end];
+		v[end] = top;
+		sift_down(v, 0, end);
+	}
+}
+
+/*
+ * mm_free_batch frees the n blocks in ptrs, skipping NULL entries, and leaves ptrs sorted by
+ * address. In that order chunks that lie next to each other in the heap are met one after the
+ * other, so they are joined into one chunk and freed with a single insert_free_list, and an
+ * arena's lock is taken once for every group of its blocks that follow each other. Blocks of
+ * other arenas are freed under their arena's lock instead of being queued for their owner.
+ */
+void mm_free_batch(void **ptrs, size_t n)
+{
+	arena *locked = NULL;
+	size_t freed = 0, bytes = 0;
+	sort_pointers(ptrs, n);
+	for (size_t i = 0; i < n; i++) {
+		void *p = ptrs[i];
+		if (p == NULL) continue;
+		header *h = payload_to_header(p);
+		slab *s = get_slab(p);
+		freed++;
+		if (s == NULL && is_huge_chunk(h)) {
+			bytes += get_payload_size(h);
+			huge_free(h);
+			continue;
+		}
+		arena *a = s != NULL ? s->owner : get_chunk_arena(h);
+		if (a != locked) {
+			if (locked != NULL) {
+				trim_top(locked);
+				UNLOCK_ARENA(locked);
+			}
+			LOCK_ARENA(a);
+			locked = a;
+		}
+		if (s != NULL) {
+			bytes += s->object_size;
+			slab_free(a, s, p);
+			continue;
+		}
+		//the payload of the chunk right after a run is never a slab object, only a slab header
+		size_t size = get_chunk_size(h);
+		bytes += size - HEADER_SIZE;
+		while (i + 1 < n && ptrs[i + 1] == header_to_payload(header_to_next_header(h, size))) {
+			size_t next_size = get_chunk_size(header_to_next_header(h, size));
+			size += next_size;
+			bytes += next_size - HEADER_SIZE;
+			freed++;
+			a->counters.coalesces++;
+			i++;
+		}
+		set_chunk_size_status(h, size, true);
+		insert_free_list(a, h);
+	}
+	if (locked != NULL) {
+		trim_top(locked);
+		UNLOCK_ARENA(locked);
+	}
+	COUNT(frees, freed);
+	count_live(-bytes);
+}
+
+/*
+ * mm_calloc allocates a zeroed block for nmemb elements of size bytes each, NULL when that
+ * overflows. Only memory that may have been used before is cleared: huge blocks come zeroed
+ * from their fresh mapping, and a chunk from the arena only needs the bytes allocate_chunk
+ * reports as dirty cleared, which leaves out whatever mem_sbrk just handed out and free chunks
+ * still zero from it. Blocks that fit in a slab are simply allocated and cleared.
+ */
+void *mm_calloc(size_t nmemb, size_t size)
+{
+	size_t bytes;
+	if (__builtin_mul_overflow(nmemb, size, &bytes) || bytes == 0 || bytes > PTRDIFF_MAX) return count_malloc(NULL);
+	if (bytes <= SLAB_MAX_OBJECT) {
+		void *p = mm_malloc(bytes);
+		if (p != NULL) memset(p, 0, bytes);
+		return p;
+	}
+
+	size_t newsize = get_newsize(bytes);
+	if (newsize >= HUGE_CHUNK) {
+		header *h = huge_alloc(newsize, HUGE_LEAD);
+		return count_malloc(h == NULL ? NULL : header_to_payload(h));
+	}
+	arena *a = get_thread_arena();
+	size_t dirty;
+	LOCK_ARENA(a);
+#ifdef MM_THREADS
+	drain_remote_frees(a);
+#endif
+	header *h = allocate_chunk(a, newsize, &dirty);
+	UNLOCK_ARENA(a);
+	if (h == NULL)
+		return count_malloc(NULL);
+	memset(header_to_payload(h), 0, dirty < bytes ? dirty : bytes);
+	return count_malloc(header_to_payload(h));
+}
+
+/*
+ * mm_memalign allocates a block of size bytes whose address is a multiple of alignment, which
+ * is rounded up to a power of two. Alignments up to ALIGNMENT are what malloc gives anyway.
+ * Others never come from slabs or thread caches: the block is carved out of a chunk with room
+ * for any offset and the free space in front of it goes back to the bins, see
+ * allocate_aligned_chunk. Huge blocks aligned to at most a page start that far into their
+ * region instead. mm_free and mm_realloc take the block like any other. Blocks whose padded
+ * chunk could not fit in the heap are not allocated.
+ */
+void *mm_memalign(size_t alignment, size_t size)
+{
+	if (alignment <= ALIGNMENT) return mm_malloc(size);
+	//no heap is large enough for a chunk padded by more, which also keeps
+	//newsize + alignment + MIN_CHUNK from overflowing below
+	if (size == 0 || size > PTRDIFF_MAX || alignment > HEAP_LIMIT / 2) return count_malloc(NULL);
+	if (alignment & (alignment - 1)) {
+		alignment = (size_t)1 << (64 - __builtin_clzl(alignment));
+	}
+
+	size_t newsize = get_newsize(size);
+	if (newsize >= HUGE_CHUNK && alignment <= mem_pagesize()) {
+		header *h = huge_alloc(newsize, alignment);
+		return count_malloc(h == NULL ? NULL : header_to_payload(h));
+	}
+	arena *a = get_thread_arena();
+	LOCK_ARENA(a);
+#ifdef MM_THREADS
+	drain_remote_frees(a);
+#endif
+	header *h = NULL;
+	if (newsize + alignment + MIN_CHUNK <= HEAP_LIMIT) h = allocate_aligned_chunk(a, newsize, alignment);
+	UNLOCK_ARENA(a);
+	return count_malloc(h == NULL ? NULL : header_to_payload(h));
+}
+
+/*
+ * mm_aligned_alloc is mm_memalign for alignments that are powers of two, NULL for others
+ */
+void *mm_aligned_alloc(size_t alignment, size_t size)
+{
+	if (alignment == 0 || (alignment & (alignment - 1))) return count_malloc(NULL);
+	return mm_memalign(alignment, size);
+}
+
+//sets how much free memory the top of the heap may hold before free gives it back to the system
+//(size_t)-1 turns trimming off
+void mm_set_trim_threshold(size_t threshold)
+{
+	global_trim_threshold = threshold;
+}
 
-		if (ptr != NULL) {
-			header *h = payload_to_header(ptr); 
-			size_t copySize = get_chunk_size(h) - sizeof(header); //payload size
-			//printf("Copy size: %lu\n", copySize);
+//adds a free chunk of size bytes to info
+void heapinfo_add(mm_heapinfo_t *info, size_t size) {
+	info->free_bytes += size;
+	info->free_chunks++;
+	if (size > info->largest_free) info->largest_free = size;
+}
+
+//adds the free chunks of the tree t to info, recursing to the left and looping to the right
+void heapinfo_tree(mm_heapinfo_t *info, tree_node *t) {
+	for (; t != NULL; t = t->right) {
+		heapinfo_tree(info, t->left);
+		heapinfo_add(info, get_chunk_size((header *)t));
+	}
+}
 
-			if (size < copySize) {
-				//copySize is the minimum of new payload size and old payload size
-				copySize = size;
+//fills info with the free chunks of every arena and the free room of their slabs, walking
+//the bins, trees and slab lists. Chunks in thread caches or waiting to be handed back to
+//their arena count as allocated. Slabs are allocated chunks, so their free room is not in
+//free_bytes.
+void mm_heapinfo(mm_heapinfo_t *info)
+{
+	memset(info, 0, sizeof(*info));
+	for (int i = 0; i < NUM_ARENAS; i++) {
+		arena *a = &global_arenas[i];
+		LOCK_ARENA(a);
+		for (unsigned long map = a->bin_map; map != 0; map &= map - 1) {
+			for (header *h = a->free_bins[__builtin_ctzl(map)]; h != NULL; h = h->next) {
+				heapinfo_add(info, get_chunk_size(h));
+			}
+		}
+		heapinfo_tree(info, a->large_tree);
+		for (int j = 0; j < SLAB_CLASSES; j++) {
+			for (slab *s = a->partial_slabs[j]; s != NULL; s = s->next) {
+				info->slab_free_bytes += (size_t)s->free_count * s->object_size;
 			}
-			memcpy(newptr, ptr, copySize); //copy the old payload into its new location
+		}
+		for (slab *s = a->empty_slabs; s != NULL; s = s->next) {
+			info->slab_free_bytes += SLAB_SIZE - HEADER_SIZE - SLAB_HEADER_SIZE;
+		}
+		UNLOCK_ARENA(a);
+	}
+}
+
+_Static_assert(NUM_BINS + 1 <= MM_STATS_BINS, "mm_stats_t has too few bin_chunks");
+
+//fills stats with the counters, adding up those of the arenas under their locks and, in the
+//thread-safe build, those of the running threads, whose peak is only exact to LIVE_STEP bytes
+//a thread. Unlike mm_heapinfo nothing is walked, so it is cheap enough to call at any time.
+void mm_stats(mm_stats_t *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+#ifdef MM_THREADS
+	pthread_mutex_lock(&global_tcaches_lock);
+#endif
+	stats->live_bytes = __atomic_load_n(&global_counters.live_bytes, __ATOMIC_RELAXED);
+	stats->peak_bytes = __atomic_load_n(&global_counters.peak_bytes, __ATOMIC_RELAXED);
+	stats->mallocs = __atomic_load_n(&global_counters.mallocs, __ATOMIC_RELAXED);
+	stats->frees = __atomic_load_n(&global_counters.frees, __ATOMIC_RELAXED);
+	stats->reallocs = __atomic_load_n(&global_counters.reallocs, __ATOMIC_RELAXED);
+#ifdef MM_THREADS
+	//the threads' own counts, those of caches not used since mm_init are stale
+	unsigned long epoch = __atomic_load_n(&global_heap_epoch, __ATOMIC_ACQUIRE);
+	for (tcache *tc = global_tcaches; tc != NULL; tc = tc->next) {
+		if (tc->epoch != epoch) continue;
+		stats->live_bytes += __atomic_load_n(&tc->counters.live_bytes, __ATOMIC_RELAXED) -
+				     __atomic_load_n(&tc->published, __ATOMIC_RELAXED);
+		stats->mallocs += __atomic_load_n(&tc->counters.mallocs, __ATOMIC_RELAXED);
+		stats->frees += __atomic_load_n(&tc->counters.frees, __ATOMIC_RELAXED);
+		stats->reallocs += __atomic_load_n(&tc->counters.reallocs, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&global_tcaches_lock);
+	if (stats->live_bytes > stats->peak_bytes) stats->peak_bytes = stats->live_bytes;
+#endif
+	LOCK_BRK();
+	stats->heap_size = mem_heapsize() + mem_mapsize();
+	UNLOCK_BRK();
+	for (int i = 0; i < NUM_ARENAS; i++) {
+		arena *a = &global_arenas[i];
+		LOCK_ARENA(a);
+		for (int j = 0; j < NUM_BINS; j++) {
+			stats->bin_chunks[j] += a->counters.bin_chunks[j];
+		}
+		stats->bin_chunks[MM_STATS_BINS - 1] += a->counters.bin_chunks[NUM_BINS];
+		stats->splits += a->counters.splits;
+		stats->coalesces += a->counters.coalesces;
+		stats->search_steps += a->counters.search_steps;
+		UNLOCK_ARENA(a);
+	}
+}
+
+//Heap validation. Each check returns NULL when what it looked at is consistent and a description
+//of the first problem otherwise, and nothing is printed, so the checks can run between the
+//requests of a benchmark. Pointers are checked to lie in the heap before they are followed,
+//so a corrupted heap is reported instead of crashing the checker.
+#define CHECK(cond, msg) do { if (!(cond)) return (msg); } while (0)
+
+//whether a chunk of size bytes at h lies in the heap with room for an epilogue after it
+bool chunk_in_heap(header *h, size_t size) {
+	char *lo = (char *)mem_heap_lo() + HEADER_SIZE;
+	char *end = (char *)mem_heap_hi() + 1 - HEADER_SIZE;
+	return (char *)h >= lo && (char *)h < end && is_aligned(header_to_payload(h)) &&
+	       size <= (size_t)(end - (char *)h);
+}
+
+//checks a chunk in the bins or the tree of arena a: it is a free chunk of a with a matching
+//footer, and both of its neighbours are allocated, since frees coalesce
+const char *validate_free_chunk(arena *a, header *h) {
+	CHECK(chunk_in_heap(h, 0), "free list entry outside the heap");
+	size_t size = get_chunk_size(h);
+	CHECK(size >= MIN_CHUNK && size % ALIGNMENT == 0 && chunk_in_heap(h, size), "free chunk of a bad size");
+	CHECK(get_chunk_status(h) == false, "allocated chunk in the free lists");
+	CHECK((h->size_n_status & (ARENA_BITS | HUGE_BIT)) == a->id_bits, "free chunk of another arena in the free lists");
+	CHECK(*header_to_footer(h, size) == size, "free chunk footer does not match its header");
+	CHECK(get_prev_status(h), "free chunk follows a free chunk");
+	header *nxt = get_next_chunk(h);
+	CHECK(get_chunk_status(nxt), "free chunk precedes a free chunk");
+	CHECK(get_prev_status(nxt) == false, "chunk after a free chunk has it marked allocated");
+	return NULL;
+}
+
+//checks the bins of arena a against the bin map and their chunks, adding them to *count;
+//a list longer than limit chunks must have a cycle
+const char *validate_bins(arena *a, size_t *count, size_t limit) {
+	const char *err;
+	for (int bin = 0; bin < NUM_BINS; bin++) {
+		header *h = a->free_bins[bin];
+		CHECK(((a->bin_map >> bin) & 1) == (h != NULL), "bin map does not match the bins");
+		CHECK(h == NULL || (chunk_in_heap(h, 0) && h->prev == NULL), "first chunk of a bin has a predecessor");
+		for (; h != NULL; h = h->next) {
+			if ((err = validate_free_chunk(a, h)) != NULL) return err;
+			CHECK(get_chunk_size(h) < LARGE_CHUNK && size_to_bin(get_chunk_size(h)) == bin, "free chunk in the bin of another size");
+			CHECK(h->next == NULL || (chunk_in_heap(h->next, 0) && h->next->prev == h), "bin links do not match");
+			CHECK(++*count <= limit, "cycle in a bin");
 		}
 	}
-	if (ptr != NULL) {
-	    mm_free(ptr); 
+	CHECK((a->bin_map >> NUM_BINS) == 0, "bin map has bits past the bins");
+	return NULL;
+}
+
+//checks the subtree t of arena a's tree: every node is a large free chunk ordered after lo
+//and before hi, either of which may be NULL, and no node has a higher priority than its
+//parent; the nodes are added to *count
+const char *validate_tree(arena *a, tree_node *t, tree_node *lo, tree_node *hi, size_t *count) {
+	const char *err;
+	if (t == NULL) return NULL;
+	if ((err = validate_free_chunk(a, (header *)t)) != NULL) return err;
+	CHECK(get_chunk_size((header *)t) >= LARGE_CHUNK, "small free chunk in the tree");
+	CHECK((lo == NULL || tree_less(lo, t)) && (hi == NULL || tree_less(t, hi)), "tree out of order");
+	CHECK((t->left == NULL || tree_priority(t->left) <= tree_priority(t)) &&
+	      (t->right == NULL || tree_priority(t->right) <= tree_priority(t)), "tree out of heap order");
+	++*count;
+	if ((err = validate_tree(a, t->left, lo, t, count)) != NULL) return err;
+	return validate_tree(a, t->right, t, hi, count);
+}
+
+//checks that s is a slab of arena a: its page is marked, its chunk is an allocated chunk of a
+//holding the page, and its free count and object size agree with its bitmap and object count
+const char *validate_slab(arena *a, slab *s) {
+	CHECK(((uintptr_t)s & (SLAB_SIZE - 1)) == 0 && get_slab(s) == s, "slab on a page not marked as one");
+	header *h = payload_to_header(s);
+	//a slab chunk is SLAB_SIZE bytes, unless what was left after it was too small to split off
+	size_t size = get_chunk_size(h);
+	CHECK(size >= SLAB_SIZE && size < SLAB_SIZE + MIN_CHUNK && chunk_in_heap(h, size) && get_chunk_status(h),
+	      "slab chunk is not an allocated slab page");
+	CHECK(s->owner == a && get_chunk_arena(h) == a, "slab of another arena");
+	int free_objects = 0;
+	for (int i = 0; i < SLAB_MAP_WORDS; i++) {
+		free_objects += __builtin_popcountl(s->free_map[i]);
+	}
+	CHECK(free_objects == s->free_count && s->free_count <= s->num_objects, "slab free count does not match its bitmap");
+	if (s->object_size == 0) {
+		CHECK(s->free_count == s->num_objects, "empty slab has allocated objects");
+	} else {
+		CHECK(s->object_size % ALIGNMENT == 0 && s->object_size <= SLAB_MAX_OBJECT &&
+		      s->num_objects == (int)((SLAB_SIZE - HEADER_SIZE - SLAB_HEADER_SIZE) / s->object_size), "slab of a bad object size");
+	}
+	return NULL;
+}
+
+//checks the slab list at head of arena a, whose slabs all have object_size bytes objects and
+//free ones, adding them to *count
+const char *validate_slab_list(arena *a, slab *head, size_t object_size, size_t *count, size_t limit) {
+	const char *err;
+	CHECK(head == NULL || (get_slab(head) == head && head->prev == NULL), "first slab of a list has a predecessor");
+	for (slab *s = head; s != NULL; s = s->next) {
+		if ((err = validate_slab(a, s)) != NULL) return err;
+		CHECK(s->object_size == object_size && s->free_count > 0, "slab in the wrong list");
+		CHECK(s->next == NULL || (get_slab(s->next) == s->next && s->next->prev == s), "slab links do not match");
+		CHECK(++*count <= limit, "cycle in a slab list");
+	}
+	return NULL;
+}
+
+//checks the header an arena keeps as the epilogue of the extent it grows
+const char *validate_epilogue(arena *a) {
+	header *e = a->epilogue;
+	if (e == NULL) return NULL;
+	CHECK((char *)e >= (char *)mem_heap_lo() + HEADER_SIZE && (char *)e + HEADER_SIZE <= (char *)mem_heap_hi() + 1 &&
+	      is_aligned(header_to_payload(e)), "epilogue outside the heap");
+	CHECK((e->size_n_status & ~(size_t)PREV_ALLOC_BIT) == (a->id_bits | ALLOC_BIT), "epilogue is not an allocated zero sized header of its arena");
+	return NULL;
+}
+
+//Walks every chunk of every extent in address order: the chunks must tile each extent up to its
+//epilogue with the status bits of neighbours agreeing, no two free chunks may be adjacent and
+//every slab must agree with its bitmap. Counts the free chunks, the slabs with free objects and
+//the empty slabs on the way, and sets found[i] when arena i's epilogue is met.
+const char *validate_extents(size_t *free_chunks, size_t *partial, size_t *empty, size_t *slabs, bool *found) {
+	const char *err;
+	char *end = (char *)mem_heap_hi() + 1;
+	header *h = (header *)((char *)mem_heap_lo() + HEADER_SIZE);
+	bool prev_alloc = true;
+	if (mem_heapsize() == 0) return NULL;
+	for (;;) {
+		CHECK((char *)h + HEADER_SIZE <= end, "extent runs past the heap without an epilogue");
+		CHECK(get_prev_status(h) == prev_alloc, "chunk has the status of the chunk before it wrong");
+		CHECK((h->size_n_status >> ARENA_SHIFT) < NUM_ARENAS && (h->size_n_status & HUGE_BIT) == 0, "chunk header has bad arena or huge bits");
+		size_t size = get_chunk_size(h);
+		if (size == 0) {
+			//an epilogue, the pad of the next extent follows it
+			CHECK(get_chunk_status(h), "epilogue not allocated");
+			arena *a = get_chunk_arena(h);
+			if (a->epilogue == h) found[a - global_arenas] = true;
+			if ((char *)h + HEADER_SIZE == end) return NULL;
+			h = (header *)((char *)h + 2 * HEADER_SIZE);
+			prev_alloc = true;
+			continue;
+		}
+		CHECK(size % ALIGNMENT == 0 && size >= MIN_CHUNK && chunk_in_heap(h, size), "chunks do not tile the extent");
+		if (get_chunk_status(h)) {
+			slab *s = get_slab(header_to_payload(h));
+			if (s != NULL) {
+				CHECK(s->owner >= global_arenas && s->owner < global_arenas + NUM_ARENAS, "slab of no arena");
+				if ((err = validate_slab(s->owner, s)) != NULL) return err;
+				++*slabs;
+				if (s->object_size == 0) {
+					++*empty;
+				} else if (s->free_count > 0) {
+					++*partial;
+				}
+			}
+		} else {
+			CHECK(prev_alloc, "adjacent free chunks");
+			CHECK(*header_to_footer(h, size) == size, "free chunk footer does not match its header");
+			++*free_chunks;
+		}
+		prev_alloc = get_chunk_status(h);
+		h = get_next_chunk(h);
 	}
-	return newptr;
 }
 
+/*
+ * mm_validate checks the consistency of the heap without printing anything and returns NULL if
+ * it is consistent, a description of the first problem found otherwise.
+ * MM_CHECK_FAST checks the free chunks in the bins and trees, the bin maps and the slab lists
+ * of every arena, which costs time in proportion to the free chunks and partial slabs.
+ * MM_CHECK_DEEP also walks every extent once: chunks must tile it, and the free chunks and slabs
+ * met must be exactly those in the bins, trees and slab lists. Cached and remotely freed blocks
+ * of the thread-safe build count as allocated, and other threads must not be using the
+ * allocator meanwhile.
+ */
+const char *mm_validate(int mode)
+{
+	const char *err;
+	size_t free_chunks = 0, partial = 0, empty = 0;
+	size_t limit = mem_heapsize() / MIN_CHUNK + 1;
+	for (int i = 0; i < NUM_ARENAS; i++) {
+		arena *a = &global_arenas[i];
+		if ((err = validate_epilogue(a)) != NULL) return err;
+		if ((err = validate_bins(a, &free_chunks, limit)) != NULL) return err;
+		if ((err = validate_tree(a, a->large_tree, NULL, NULL, &free_chunks)) != NULL) return err;
+		for (int j = 0; j < SLAB_CLASSES; j++) {
+			err = validate_slab_list(a, a->partial_slabs[j], (size_t)(j + 1) * ALIGNMENT, &partial, limit);
+			if (err != NULL) return err;
+		}
+		if ((err = validate_slab_list(a, a->empty_slabs, 0, &empty, limit)) != NULL) return err;
+	}
+	if (mode == MM_CHECK_FAST) return NULL;
+
+	size_t walked_free = 0, walked_partial = 0, walked_empty = 0, walked_slabs = 0, marked = 0;
+	bool found[NUM_ARENAS] = {false};
+	err = validate_extents(&walked_free, &walked_partial, &walked_empty, &walked_slabs, found);
+	if (err != NULL) return err;
+	CHECK(walked_free == free_chunks, "free chunk missing from the free lists");
+	CHECK(walked_partial == partial && walked_empty == empty, "slab missing from the slab lists");
+	for (int i = 0; i < NUM_ARENAS; i++) {
+		CHECK(global_arenas[i].epilogue == NULL || found[i], "arena epilogue is not the end of an extent");
+	}
+	for (size_t i = 0; i < global_slab_words; i++) {
+		marked += __builtin_popcountl(global_slab_pages[i]);
+	}
+	CHECK(marked == walked_slabs, "page marked as a slab that is not the payload of a slab chunk");
+	return NULL;
+}
 
 /*
  * mm_checkheap checks the integrity of the heap and helps with debugging
  * Naive implementation of checkheap greatly helped in ensuring that pointer arithmetic was correct
- * 
+ * Every extent is walked from after its pad to its zero sized epilogue, the next extent starts
+ * right after that. Other threads must not be using the allocator while the heap is walked.
  */
-void mm_checkheap(int verbose_level) 
+void mm_checkheap(int verbose_level)
 {
-	// Your code here
 	size_t total_allocated = 0, total_free = 0;
 	size_t total_allocated_sz = 0, total_free_sz = 0;
 	header *h;
-	h = mem_heap_lo();
+	//the walk below trusts the chunk sizes, so it only runs on a heap that validates
+	const char *err = mm_validate(MM_CHECK_DEEP);
+	if (err != NULL) {
+		printf("heap check failed: %s\n", err);
+		return;
+	}
+	h = (header *)((char *)mem_heap_lo() + HEADER_SIZE);
 	// do a simple check by traversing all the chunks and print out their size and status
 	while ((void *)h < mem_heap_hi()) {
-		size_t x = mem_heapsize();
-		printf("%zx\n", x);
-		printf("%d %lu %lu\n", get_newsize(h->size), (unsigned long) mem_heap_lo(), 
-		(unsigned long) mem_heap_hi());
-		my_assert(h->next == header_to_next_header(h,h->next->size));
-
+		if (get_chunk_size(h) == 0) {
+			//epilogue, skip it and the pad of the next extent
+			h = (header *)((char *)h + 2 * HEADER_SIZE);
+			continue;
+		}
 		if (verbose_level > NORMAL_VERBOSE) {
 		       	printf("chunk size %ld status %d\n", get_chunk_size(h), get_chunk_status(h));
 		}
 		if (get_chunk_status(h)) {
 			total_allocated_sz += get_chunk_size(h);
 			total_allocated++;
+			slab *s = get_slab(header_to_payload(h));
+			if (s != NULL) {
+				if (verbose_level > NORMAL_VERBOSE) {
+					printf("slab object size %ld free objects %d of %d\n", s->object_size, s->free_count, s->num_objects);
+				}
+			}
 		} else {
 			total_free_sz += get_chunk_size(h);
 			total_free++;
@@ -368,4 +2219,3 @@ void mm_checkheap(int verbose_level)
 	}
 	return;
 }
-
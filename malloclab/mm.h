@@ -3,9 +3,60 @@
 
 #define NORMAL_VERBOSE 1
 
+/* modes of mm_validate */
+#define MM_CHECK_FAST 0 /* free lists and slab lists only */
+#define MM_CHECK_DEEP 1 /* also walk every chunk of the heap */
+
+/* free memory of the heap, as seen by mm_heapinfo */
+typedef struct {
+    size_t free_bytes;      /* bytes in free chunks */
+    size_t free_chunks;     /* number of free chunks */
+    size_t largest_free;    /* bytes in the largest free chunk */
+    size_t slab_free_bytes; /* bytes of free slab objects and empty slabs */
+} mm_heapinfo_t;
+
+/* entries of mm_stats_t.bin_chunks, the last one is for chunks too large for any bin */
+#define MM_STATS_BINS 64
+
+/* counters kept by the allocator, as read by mm_stats */
+typedef struct {
+    size_t live_bytes;   /* usable bytes of the blocks allocated now; a block
+			    freed with mm_free_sized only takes off what its
+			    size needed, up to ALIGNMENT bytes less */
+    size_t peak_bytes;   /* most live_bytes since mm_init */
+    size_t heap_size;    /* bytes of the heap and of blocks mapped on their own */
+    size_t mallocs;      /* calls that allocate a block, failed ones too, with the
+			    mm_malloc of a moving mm_realloc and each block of a batch */
+    size_t frees;        /* blocks freed, counted the same way */
+    size_t reallocs;     /* calls of mm_realloc */
+    size_t splits;       /* chunks split in two to fit a request */
+    size_t coalesces;    /* free chunks merged with a neighbour */
+    size_t search_steps; /* free chunks looked at to find one that fits */
+    size_t bin_chunks[MM_STATS_BINS]; /* free chunks in each bin */
+} mm_stats_t;
+
+/* region of objects freed all at once, see mm-arena.c */
+typedef struct mm_arena mm_arena_t;
+
 int mm_init (void);
 void *mm_malloc (size_t size);
 void mm_free (void *ptr);
+void mm_free_sized(void *ptr, size_t size);
+size_t mm_usable_size(void *ptr);
 void *mm_realloc(void *ptr, size_t size);
+void *mm_calloc(size_t nmemb, size_t size);
+size_t mm_malloc_batch(size_t size, size_t n, void **out);
+void mm_free_batch(void **ptrs, size_t n);
+void *mm_memalign(size_t alignment, size_t size);
+void *mm_aligned_alloc(size_t alignment, size_t size);
 void mm_checkheap(int verbose_level);
+const char *mm_validate(int mode);
+void mm_heapinfo(mm_heapinfo_t *info);
+void mm_stats(mm_stats_t *stats);
+void mm_set_trim_threshold(size_t threshold);
+
+mm_arena_t *mm_arena_create(size_t block_size);
+void *mm_arena_alloc(mm_arena_t *arena, size_t size);
+void mm_arena_reset(mm_arena_t *arena);
+void mm_arena_destroy(mm_arena_t *arena);
 
@@ -0,0 +1,705 @@
+/*
+ * mmtrace.c - Record the malloc requests of a process as an mdriver trace
+ *
+ * usage: LD_PRELOAD=./libmmtrace.so MMTRACE=<out> <program> [args...]
+ *        mdriver -f <out>
+ *
+ * Interposes malloc, calloc, realloc and free. Every request takes a
+ * sequence number and is appended to a buffer of the calling thread,
+ * which goes to a spool file of its own, <out>.<pid>.<n>, when it fills
+ * up. At exit the spool files are merged in sequence order into a binary
+ * trace (see trace.h) in <out>, mmtrace.bin if MMTRACE is not set.
+ *
+ * Programs the recorded process runs inherit the recorder and write
+ * their traces to <out>.<pid> instead; MMTRACE_PID tells them the pid
+ * of the process that writes <out>. A child forked without running
+ * another program is not recorded, it drops what it inherited of the
+ * parent's buffers and spool files.
+ *
+ * Live blocks are kept in a table from pointer to trace id, split into
+ * shards with a lock each. A request takes its sequence number under
+ * the lock of its pointer's shard, a free before the block goes back to
+ * malloc and an allocation after malloc returned it, so the merged
+ * requests are a valid order to replay. Ids of freed blocks are reused,
+ * so a trace needs as many ids as there were blocks live at once.
+ *
+ * Requests made before the recorder was set up, frees of blocks it has
+ * not seen and requests larger than INT_MAX are not recorded, and the
+ * recorder maps the memory it needs itself.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "trace.h"
+
+#define SHARDS       64         /* locks on the table of live blocks */
+#define TABLE_MIN    1024       /* initial slots in the table of a shard */
+#define BUF_RECORDS  4096       /* requests buffered by a thread */
+#define BOOT_SIZE    (16*1024)  /* for the allocations made by dlsym */
+#define MAXPATH      1024
+
+#define TLS __thread __attribute__((tls_model("initial-exec")))
+
+/* One recorded request and where it goes in the trace */
+typedef struct {
+    uint64_t seq;               /* position of the request in the trace */
+    traceop_t op;               /* the request */
+} record_t;
+
+/* Requests of one thread on their way to its spool file */
+typedef struct thread_buf {
+    record_t recs[BUF_RECORDS];
+    int count;                  /* records in recs */
+    int lock;                   /* held to add or write out records */
+    int idle;                   /* no thread uses this buffer */
+    int num;                    /* of this buffer, names its spool file */
+    int fd;                     /* spool file, -1 until the first flush */
+    struct thread_buf *next;    /* all buffers ever set up */
+} thread_buf_t;
+
+/* Blocks whose pointers fall into one shard, and ids to give out */
+typedef struct {
+    pthread_mutex_t lock;
+    uintptr_t *keys;            /* pointer of a live block, 0 if empty */
+    uint32_t *ids;              /* id of that block */
+    size_t cap;                 /* slots, a power of two */
+    size_t count;               /* live blocks */
+    uint32_t *free_ids;         /* ids of freed blocks to reuse */
+    size_t free_count, free_cap;
+    uint32_t next_id;           /* id of the shard not given out yet */
+} shard_t;
+
+/* Merge state of one spool file */
+typedef struct {
+    int fd;
+    record_t *recs;             /* read buffer */
+    int count, next;            /* records in recs, next one to merge */
+} spool_t;
+
+static void *(*real_malloc)(size_t);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_realloc)(void *, size_t);
+static void (*real_free)(void *);
+
+static char boot_buf[BOOT_SIZE] __attribute__((aligned(16)));
+static size_t boot_used;
+static int resolving;
+
+static int ready;               /* set up and recording */
+static char out_path[MAXPATH];
+static pid_t out_pid;           /* names the spool files */
+static uint64_t next_seq;
+static shard_t shards[SHARDS];
+static pthread_key_t buf_key;
+static pthread_mutex_t bufs_lock = PTHREAD_MUTEX_INITIALIZER;
+static thread_buf_t *bufs;
+static int num_bufs;
+
+static TLS thread_buf_t *my_buf;
+static TLS int in_recorder;     /* requests of the recorder itself */
+
+/*
+ * map_zeroed - Memory for the recorder that does not come from malloc
+ */
+static void *map_zeroed(size_t size)
+{
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+	static const char msg[] = "mmtrace: out of memory\n";
+	write(2, msg, sizeof(msg) - 1);
+	abort();
+    }
+    return p;
+}
+
+/*
+ * resolve - Look up the malloc functions this library stands in for.
+ *     dlsym may allocate, which boot_alloc serves meanwhile.
+ */
+static void resolve(void)
+{
+    resolving = 1;
+    real_malloc = dlsym(RTLD_NEXT, "malloc");
+    real_calloc = dlsym(RTLD_NEXT, "calloc");
+    real_realloc = dlsym(RTLD_NEXT, "realloc");
+    real_free = dlsym(RTLD_NEXT, "free");
+    resolving = 0;
+}
+
+static void *boot_alloc(size_t size)
+{
+    void *p;
+
+    size = (size + 15) & ~(size_t)15;
+    if (boot_used + size > BOOT_SIZE)
+	return NULL;
+    p = boot_buf + boot_used;
+    boot_used += size;
+    return p;
+}
+
+static int is_boot(void *ptr)
+{
+    return (char *)ptr >= boot_buf && (char *)ptr < boot_buf + BOOT_SIZE;
+}
+
+/*
+ * Table of live blocks. Linear probing, with the entries after a removed
+ * one shifted back so lookups can stop at the first empty slot.
+ */
+static shard_t *shard_of(void *ptr)
+{
+    return &shards[((uintptr_t)ptr >> 4) % SHARDS];
+}
+
+static size_t slot_of(shard_t *s, uintptr_t key)
+{
+    return ((key >> 10) * 0x9E3779B97F4A7C15ULL >> 20) & (s->cap - 1);
+}
+
+static void table_grow(shard_t *s)
+{
+    uintptr_t *old_keys = s->keys;
+    uint32_t *old_ids = s->ids;
+    size_t old_cap = s->cap, i, j;
+
+    s->cap = old_cap ? 2 * old_cap : TABLE_MIN;
+    s->keys = map_zeroed(s->cap * sizeof(uintptr_t));
+    s->ids = map_zeroed(s->cap * sizeof(uint32_t));
+    for (i = 0; i < old_cap; i++) {
+	if (!old_keys[i])
+	    continue;
+	for (j = slot_of(s, old_keys[i]); s->keys[j]; j = (j + 1) & (s->cap - 1))
+	    ;
+	s->keys[j] = old_keys[i];
+	s->ids[j] = old_ids[i];
+    }
+    if (old_cap) {
+	munmap(old_keys, old_cap * sizeof(uintptr_t));
+	munmap(old_ids, old_cap * sizeof(uint32_t));
+    }
+}
+
+static void table_insert(shard_t *s, void *ptr, uint32_t id)
+{
+    size_t i;
+
+    if (2 * (s->count + 1) > s->cap)
+	table_grow(s);
+    for (i = slot_of(s, (uintptr_t)ptr); s->keys[i]; i = (i + 1) & (s->cap - 1))
+	;
+    s->keys[i] = (uintptr_t)ptr;
+    s->ids[i] = id;
+    s->count++;
+}
+
+/* Removes ptr from the table, returns its id or -1 if it was not there */
+static int64_t table_remove(shard_t *s, void *ptr)
+{
+    size_t i, j, home;
+    uint32_t id;
+
+    if (!s->cap)
+	return -1;
+    for (i = slot_of(s, (uintptr_t)ptr); s->keys[i] != (uintptr_t)ptr;
+	 i = (i + 1) & (s->cap - 1))
+	if (!s->keys[i])
+	    return -1;
+    id = s->ids[i];
+    s->count--;
+    for (j = i;;) {
+	s->keys[i] = 0;
+	do {
+	    j = (j + 1) & (s->cap - 1);
+	    if (!s->keys[j])
+		return id;
+	    home = slot_of(s, s->keys[j]);
+	} while (i <= j ? (i < home && home <= j) : (i < home || home <= j));
+	s->keys[i] = s->keys[j];
+	s->ids[i] = s->ids[j];
+	i = j;
+    }
+}
+
+static uint32_t new_id(shard_t *s)
+{
+    if (s->free_count)
+	return s->free_ids[--s->free_count];
+    return s->next_id++ * SHARDS + (uint32_t)(s - shards);
+}
+
+static void release_id(shard_t *s, uint32_t id)
+{
+    if (s->free_count == s->free_cap) {
+	uint32_t *old = s->free_ids;
+	size_t old_cap = s->free_cap;
+
+	s->free_cap = old_cap ? 2 * old_cap : TABLE_MIN;
+	s->free_ids = map_zeroed(s->free_cap * sizeof(uint32_t));
+	if (old_cap) {
+	    memcpy(s->free_ids, old, old_cap * sizeof(uint32_t));
+	    munmap(old, old_cap * sizeof(uint32_t));
+	}
+    }
+    s->free_ids[s->free_count++] = id;
+}
+
+/*
+ * Buffers of the threads and their spool files
+ */
+static void buf_lock(thread_buf_t *b)
+{
+    while (__atomic_exchange_n(&b->lock, 1, __ATOMIC_ACQUIRE))
+	sched_yield();
+}
+
+static void buf_unlock(thread_buf_t *b)
+{
+    __atomic_store_n(&b->lock, 0, __ATOMIC_RELEASE);
+}
+
+static void spool_path(char *path, int num)
+{
+    snprintf(path, MAXPATH + 32, "%s.%d.%d", out_path, (int)out_pid, num);
+}
+
+/* Writes out the records of b, which the caller holds */
+static void buf_flush(thread_buf_t *b)
+{
+    char path[MAXPATH + 32];
+    size_t len = b->count * sizeof(record_t), done = 0;
+    ssize_t n;
+
+    if (!b->count)
+	return;
+    if (b->fd < 0) {
+	spool_path(path, b->num);
+	if ((b->fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0644)) < 0) {
+	    perror(path);
+	    abort();
+	}
+    }
+    while (done < len) {
+	if ((n = write(b->fd, (char *)b->recs + done, len - done)) < 0) {
+	    perror("mmtrace: write to spool file");
+	    abort();
+	}
+	done += n;
+    }
+    b->count = 0;
+}
+
+/* Flushes the buffer of an exiting thread and lets another one take it */
+static void thread_exit(void *arg)
+{
+    thread_buf_t *b = arg;
+
+    if (!ready)
+	return;		/* mmtrace_fini has taken the buffers */
+    in_recorder = 1;
+    buf_lock(b);
+    buf_flush(b);
+    buf_unlock(b);
+    pthread_mutex_lock(&bufs_lock);
+    b->idle = 1;
+    pthread_mutex_unlock(&bufs_lock);
+    my_buf = NULL;
+    in_recorder = 0;
+}
+
+/*
+ * thread_buffer - The buffer of this thread. One left by a thread that
+ *     exited is reused; its spool file stays in sequence order, as the
+ *     new thread's requests all come after those of the old one.
+ */
+static thread_buf_t *thread_buffer(void)
+{
+    thread_buf_t *b;
+
+    if (my_buf)
+	return my_buf;
+    pthread_mutex_lock(&bufs_lock);
+    for (b = bufs; b && !b->idle; b = b->next)
+	;
+    if (b)
+	b->idle = 0;
+    else {
+	b = map_zeroed(sizeof(thread_buf_t));
+	b->fd = -1;
+	b->num = num_bufs++;
+	b->next = bufs;
+	bufs = b;
+    }
+    pthread_mutex_unlock(&bufs_lock);
+    pthread_setspecific(buf_key, b);
+    return my_buf = b;
+}
+
+static void record(thread_buf_t *b, uint64_t seq, int type, uint32_t id,
+		   size_t size)
+{
+    record_t *r;
+
+    buf_lock(b);
+    if (b->count == BUF_RECORDS)
+	buf_flush(b);
+    r = &b->recs[b->count++];
+    r->seq = seq;
+    r->op.type = type;
+    r->op.index = id;
+    r->op.size = size;
+    buf_unlock(b);
+}
+
+static uint64_t take_seq(void)
+{
+    return __atomic_fetch_add(&next_seq, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Recording of the requests, each called with the result of the request
+ * made, or before a block is given back
+ */
+static void record_alloc(void *ptr, size_t size)
+{
+    shard_t *s = shard_of(ptr);
+    uint64_t seq;
+    uint32_t id;
+
+    /* replaying malloc(0) must give a block as well */
+    if (size == 0)
+	size = 1;
+    in_recorder = 1;
+    pthread_mutex_lock(&s->lock);
+    id = new_id(s);
+    table_insert(s, ptr, id);
+    seq = take_seq();
+    pthread_mutex_unlock(&s->lock);
+    record(thread_buffer(), seq, ALLOC, id, size);
+    in_recorder = 0;
+}
+
+/* Returns the id of ptr, or -1 if it was not recorded */
+static int64_t record_free(void *ptr, int keep_id)
+{
+    shard_t *s = shard_of(ptr);
+    int64_t id;
+    uint64_t seq;
+
+    in_recorder = 1;
+    pthread_mutex_lock(&s->lock);
+    id = table_remove(s, ptr);
+    if (id >= 0 && !keep_id) {
+	release_id(s, id);
+	seq = take_seq();
+    }
+    pthread_mutex_unlock(&s->lock);
+    if (id >= 0 && !keep_id)
+	record(thread_buffer(), seq, FREE, id, 0);
+    in_recorder = 0;
+    return id;
+}
+
+/* ptr was the block id, grown or shrunk to size */
+static void record_realloc(void *ptr, uint32_t id, size_t size)
+{
+    shard_t *s = shard_of(ptr);
+    uint64_t seq;
+
+    in_recorder = 1;
+    pthread_mutex_lock(&s->lock);
+    table_insert(s, ptr, id);
+    seq = take_seq();
+    pthread_mutex_unlock(&s->lock);
+    record(thread_buffer(), seq, REALLOC, id, size);
+    in_recorder = 0;
+}
+
+static int recording(void)
+{
+    return ready && !in_recorder;
+}
+
+/*
+ * The interposed functions
+ */
+void *malloc(size_t size)
+{
+    void *p;
+
+    if (!real_malloc) {
+	if (resolving)
+	    return boot_alloc(size);
+	resolve();
+    }
+    p = real_malloc(size);
+    if (p && size <= INT_MAX && recording())
+	record_alloc(p, size);
+    return p;
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    void *p;
+
+    if (!real_calloc) {
+	if (resolving)
+	    return boot_alloc(nmemb * size); /* static, so zeroed */
+	resolve();
+    }
+    p = real_calloc(nmemb, size);
+    if (p && nmemb * size <= INT_MAX && recording())
+	record_alloc(p, nmemb * size);
+    return p;
+}
+
+void free(void *ptr)
+{
+    if (!ptr || is_boot(ptr))
+	return;
+    if (!real_free)
+	resolve();
+    if (recording())
+	record_free(ptr, 0);
+    real_free(ptr);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    int64_t id = -1;
+    void *p;
+
+    if (is_boot(ptr)) {
+	if ((p = malloc(size)) != NULL)
+	    memcpy(p, ptr, size < BOOT_SIZE ? size : BOOT_SIZE);
+	return p;
+    }
+    if (!real_realloc)
+	resolve();
+    if (!recording())
+	return real_realloc(ptr, size);
+    if (!ptr)
+	return malloc(size);
+    if (size == 0 || size > INT_MAX) {
+	/* gives the block back, or leaves it unrecorded from here */
+	record_free(ptr, 0);
+	return real_realloc(ptr, size);
+    }
+
+    /* the old pointer may be handed out again once realloc returns */
+    id = record_free(ptr, 1);
+    p = real_realloc(ptr, size);
+    if (id < 0) {
+	if (p)
+	    record_alloc(p, size);
+    }
+    else if (p)
+	record_realloc(p, id, size);
+    else {
+	/* the block is unchanged, and so is the trace */
+	shard_t *s = shard_of(ptr);
+	in_recorder = 1;
+	pthread_mutex_lock(&s->lock);
+	table_insert(s, ptr, id);
+	pthread_mutex_unlock(&s->lock);
+	in_recorder = 0;
+    }
+    return p;
+}
+
+/*
+ * fork_child - A forked child stops recording. The buffers hold requests
+ *     of the parent, which writes them out itself, and their spool files
+ *     are the parent's. Only the forking thread runs on in the child, so
+ *     no lock is taken.
+ */
+static void fork_child(void)
+{
+    thread_buf_t *b;
+
+    ready = 0;
+    for (b = bufs; b; b = b->next) {
+	if (b->fd >= 0)
+	    close(b->fd);
+	b->fd = -1;
+	b->count = 0;
+    }
+}
+
+/*
+ * Set up and merge
+ */
+__attribute__((constructor))
+static void mmtrace_init(void)
+{
+    char *path = getenv("MMTRACE");
+    char *root = getenv("MMTRACE_PID");
+    char pid[16];
+    int i;
+
+    in_recorder = 1;
+    if (!real_malloc)
+	resolve();
+    path = path && *path ? path : "mmtrace.bin";
+    out_pid = getpid();
+    if (root && atoi(root) != out_pid)
+	snprintf(out_path, MAXPATH, "%s.%d", path, (int)out_pid);
+    else {
+	snprintf(out_path, MAXPATH, "%s", path);
+	snprintf(pid, sizeof(pid), "%d", (int)out_pid);
+	setenv("MMTRACE_PID", pid, 1);
+    }
+    pthread_atfork(NULL, NULL, fork_child);
+    for (i = 0; i < SHARDS; i++)
+	pthread_mutex_init(&shards[i].lock, NULL);
+    pthread_key_create(&buf_key, thread_exit);
+    in_recorder = 0;
+    ready = 1;
+}
+
+/* Next record of a spool file in seq order, NULL once it is used up */
+static record_t *spool_head(spool_t *sp)
+{
+    ssize_t n;
+
+    if (sp->next == sp->count) {
+	n = read(sp->fd, sp->recs, BUF_RECORDS * sizeof(record_t));
+	if (n <= 0)
+	    return NULL;
+	sp->count = n / sizeof(record_t);
+	sp->next = 0;
+    }
+    return &sp->recs[sp->next];
+}
+
+static void heap_down(spool_t **heap, int n, int i)
+{
+    spool_t *tmp;
+    int c;
+
+    for (; (c = 2 * i + 1) < n; i = c) {
+	if (c + 1 < n && spool_head(heap[c + 1])->seq < spool_head(heap[c])->seq)
+	    c++;
+	if (spool_head(heap[i])->seq <= spool_head(heap[c])->seq)
+	    break;
+	tmp = heap[i];
+	heap[i] = heap[c];
+	heap[c] = tmp;
+    }
+}
+
+/*
+ * mmtrace_fini - Stop recording and merge the spool files by sequence
+ *     number into the trace, with a min-heap on the next record of each
+ */
+__attribute__((destructor))
+static void mmtrace_fini(void)
+{
+    thread_buf_t *b;
+    spool_t *spools, **heap;
+    trace_hdr_t hdr;
+    char path[MAXPATH + 32];
+    int out, n = 0, i;
+    uint32_t max_id = 0;
+    int64_t num_ops = 0;
+
+    if (!ready)
+	return;
+    ready = 0;
+    in_recorder = 1;
+
+    /* the buffers stay locked until the end, their records are the read
+       buffers now */
+    spools = map_zeroed((num_bufs + 1) * sizeof(spool_t));
+    heap = map_zeroed((num_bufs + 1) * sizeof(spool_t *));
+    pthread_mutex_lock(&bufs_lock);
+    for (b = bufs; b; b = b->next) {
+	buf_lock(b);
+	buf_flush(b);
+	if (b->fd >= 0) {
+	    lseek(b->fd, 0, SEEK_SET);
+	    spools[n].fd = b->fd;
+	    spools[n].recs = b->recs; /* no longer needed for buffering */
+	    if (spool_head(&spools[n])) {
+		heap[n] = &spools[n];
+		n++;
+	    }
+	}
+    }
+    for (i = n / 2 - 1; i >= 0; i--)
+	heap_down(heap, n, i);
+
+    if ((out = open(out_path, O_CREAT | O_TRUNC | O_WRONLY, 0644)) < 0) {
+	/* the spool files are left behind, they hold the records */
+	perror(out_path);
+	for (b = bufs; b; b = b->next) {
+	    if (b->fd >= 0) {
+		close(b->fd);
+		b->fd = -1;
+	    }
+	    b->count = 0;
+	    buf_unlock(b);
+	}
+	pthread_mutex_unlock(&bufs_lock);
+	return;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+    lseek(out, sizeof(hdr), SEEK_SET);
+    while (n > 0) {
+	/* take records of the spool at the top while it has the smallest */
+	spool_t *sp = heap[0];
+	traceop_t ops[BUF_RECORDS];
+	int k = 0;
+
+	do {
+	    record_t *r = spool_head(sp);
+	    ops[k++] = r->op;
+	    if (r->op.type != FREE && r->op.index > max_id)
+		max_id = r->op.index;
+	    sp->next++;
+	    if (!spool_head(sp)) {
+		heap[0] = heap[--n];
+		break;
+	    }
+	} while (k < BUF_RECORDS &&
+		 (n == 1 || spool_head(sp)->seq <
+		  spool_head(heap[1])->seq) &&
+		 (n < 3 || spool_head(sp)->seq < spool_head(heap[2])->seq));
+	heap_down(heap, n, 0);
+	if (write(out, ops, k * sizeof(traceop_t)) != (ssize_t)(k * sizeof(traceop_t))) {
+	    perror(out_path);
+	    break;
+	}
+	num_ops += k;
+    }
+
+    hdr.num_ids = num_ops ? max_id + 1 : 0;
+    hdr.num_ops = num_ops > INT_MAX ? INT_MAX : num_ops;
+    hdr.weight = 1;
+    pwrite(out, &hdr, sizeof(hdr), 0);
+    if (num_ops > INT_MAX)
+	ftruncate(out, sizeof(hdr) + (off_t)INT_MAX * sizeof(traceop_t));
+    close(out);
+
+    for (b = bufs; b; b = b->next) {
+	if (b->fd >= 0) {
+	    close(b->fd);
+	    b->fd = -1;
+	    spool_path(path, b->num);
+	    unlink(path);
+	}
+	b->count = 0;
+	buf_unlock(b);
+    }
+    pthread_mutex_unlock(&bufs_lock);
+}
@@ -0,0 +1,69 @@
+#!/bin/sh
+#
+# policy-table.sh - Tabulate the utilization and throughput of mdriver-<policy>
+#     for every trace, one column per placement policy
+#
+# usage: policy-table.sh [policy ...] [-- mdriver options]
+#
+# The drivers are built by "make policies". Without policies all of those
+# of the Makefile are compared; mdriver options such as -f <file> or
+# -t <dir> pick the traces. The last rows are the averages and the
+# performance index mdriver gives each policy.
+#
+policies=
+while [ $# -gt 0 ] && [ "$1" != "--" ]; do
+    policies="$policies $1"
+    shift
+done
+[ "$1" = "--" ] && shift
+[ -n "$policies" ] || policies="best good first next lifo"
+
+out=$(mktemp) || exit 1
+trap 'rm -f "$out"' EXIT
+for p in $policies; do
+    if [ ! -x "./mdriver-$p" ]; then
+	echo "policy-table.sh: ./mdriver-$p not found, run make policies" >&2
+	exit 1
+    fi
+    # the per-trace lines of the mm results, then the index, tagged with p
+    ./mdriver-$p -v "$@" 2>&1 | awk -v p="$p" '
+	/^Results for mm malloc:/ { mm = 1; next }
+	mm && NF == 0 { mm = 0 }
+	mm && $2 == "yes" { print p, $1, $3, $6 }
+	mm && $2 == "no" { print p, $1, "-", "-" }
+	/average performance index/ { print p, "index", $(NF-3), "" }
+    ' >> "$out"
+done
+
+awk -v policies="$policies" '
+    BEGIN { n = split(policies, pol, " ") }
+    $2 == "index" { index_of[$1] = $3; next }
+    {
+	if (!($2 in seen)) { seen[$2] = 1; traces[++t] = $2 }
+	util[$1, $2] = $3
+	kops[$1, $2] = $4
+	sub("%", "", $3)
+	usum[$1] += $3; ksum[$1] += $4; count[$1]++
+    }
+    END {
+	printf "%-6s", "trace"
+	for (i = 1; i <= n; i++) printf "  %10s %8s", pol[i] " util", "Kops"
+	printf "\n"
+	for (j = 1; j <= t; j++) {
+	    printf "%-6s", traces[j]
+	    for (i = 1; i <= n; i++)
+		printf "  %10s %8s", util[pol[i], traces[j]], kops[pol[i], traces[j]]
+	    printf "\n"
+	}
+	printf "%-6s", "avg"
+	for (i = 1; i <= n; i++)
+	    if (count[pol[i]])
+		printf "  %9.1f%% %8.0f", usum[pol[i]] / count[pol[i]],
+		    ksum[pol[i]] / count[pol[i]]
+	    else
+		printf "  %10s %8s", "-", "-"
+	printf "\n%-6s", "index"
+	for (i = 1; i <= n; i++) printf "  %10s %8s", index_of[pol[i]], ""
+	printf "\n"
+    }
+' "$out"
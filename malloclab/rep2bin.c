@@ -0,0 +1,94 @@
+/*
+ * rep2bin.c - Convert a text .rep trace into a binary trace for mdriver
+ *
+ * usage: rep2bin <in.rep> <out>
+ *
+ * The requests are written out as they are read, so the size of the
+ * trace does not matter. The format is described in trace.h.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "trace.h"
+
+/*
+ * convert_error - Report a problem with the input trace and exit
+ */
+static void convert_error(const char *path, long line, const char *msg)
+{
+    fprintf(stderr, "rep2bin: %s:%ld: %s\n", path, line, msg);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    FILE *in, *out;
+    trace_hdr_t hdr;
+    traceop_t op;
+    char type[2];
+    unsigned index, size;
+    long line = 4, num_ops = 0;
+
+    if (argc != 3) {
+	fprintf(stderr, "usage: %s <in.rep> <out>\n", argv[0]);
+	exit(1);
+    }
+    if ((in = fopen(argv[1], "r")) == NULL) {
+	perror(argv[1]);
+	exit(1);
+    }
+    if ((out = fopen(argv[2], "w")) == NULL) {
+	perror(argv[2]);
+	exit(1);
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+    if (fscanf(in, "%d %d %d %d", &hdr.sugg_heapsize, &hdr.num_ids,
+	       &hdr.num_ops, &hdr.weight) != 4)
+	convert_error(argv[1], 1, "bad header");
+    if (hdr.num_ids < 0 || (unsigned)hdr.num_ids > (1U << 30))
+	convert_error(argv[1], 2, "too many ids");
+    fwrite(&hdr, sizeof(hdr), 1, out);
+
+    /* Write out every request line as it is read */
+    while (fscanf(in, "%1s", type) == 1) {
+	line++;
+	memset(&op, 0, sizeof(op));
+	switch (type[0]) {
+	case 'a':
+	case 'r':
+	    if (fscanf(in, "%u %u", &index, &size) != 2)
+		convert_error(argv[1], line, "bad request");
+	    if (size > INT_MAX)
+		convert_error(argv[1], line, "request too large");
+	    op.type = type[0] == 'a' ? ALLOC : REALLOC;
+	    op.size = size;
+	    break;
+	case 'f':
+	    if (fscanf(in, "%u", &index) != 1)
+		convert_error(argv[1], line, "bad request");
+	    op.type = FREE;
+	    break;
+	default:
+	    convert_error(argv[1], line, "bogus type character");
+	}
+	if (index >= (unsigned)hdr.num_ids)
+	    convert_error(argv[1], line, "index out of range");
+	op.index = index;
+	fwrite(&op, sizeof(op), 1, out);
+	if (++num_ops > INT_MAX)
+	    convert_error(argv[1], line, "too many requests");
+    }
+    if (num_ops != hdr.num_ops)
+	convert_error(argv[1], line, "request count does not match header");
+
+    fclose(in);
+    if (fclose(out) != 0) {
+	perror(argv[2]);
+	exit(1);
+    }
+    return 0;
+}
@@ -0,0 +1,31 @@
+/*
+ * trace.h - Requests of a trace and the binary trace file format
+ *
+ * A binary trace is a trace_hdr_t followed by num_ops traceop_t records
+ * in the byte order of the machine that wrote it. mdriver maps such a
+ * file and replays the records where they are, so a trace with hundreds
+ * of millions of requests is never parsed or copied into memory. rep2bin
+ * converts a text .rep trace into one.
+ */
+#include <stdint.h>
+
+#define TRACE_MAGIC "mmtrace1" /* first 8 bytes of a binary trace */
+
+/* Types of request */
+enum {ALLOC, FREE, REALLOC};
+
+/* Characterizes a single trace operation (allocator request) */
+typedef struct {
+    uint32_t type : 2;    /* type of request */
+    uint32_t index : 30;  /* index for free() to use later */
+    int32_t size;         /* byte size of alloc/realloc request, 0 for free */
+} traceop_t;
+
+/* Header of a binary trace, the fields of the first lines of a .rep */
+typedef struct {
+    char magic[8];          /* TRACE_MAGIC, not NUL terminated */
+    int32_t sugg_heapsize;  /* suggested heap size (unused) */
+    int32_t num_ids;        /* number of alloc/realloc ids */
+    int32_t num_ops;        /* number of requests following the header */
+    int32_t weight;         /* weight for this trace (unused) */
+} trace_hdr_t;